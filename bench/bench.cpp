@@ -0,0 +1,689 @@
+#include "renderer.hpp"
+#include "replay.hpp"
+#include "mapfile.hpp"
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <filesystem>
+#include <random>
+#include <string>
+#include <stdexcept>
+#include <vector>
+
+namespace {
+
+struct Res {
+	uint32_t w;
+	uint32_t h;
+};
+
+static constexpr Res resolutions[] = {
+	{320, 200},
+	{640, 480},
+	{1280, 720},
+	{1600, 900},
+	{1920, 1080}
+};
+
+struct Cam {
+	ivec2 p;
+	int32_t ele;
+};
+
+// camera paths are sampled at frame t out of n, so every run renders the exact same frames
+struct Path {
+	const char *name;
+	Cam (*at)(int32_t t, int32_t n);
+};
+
+static const Path paths[] = {
+	{"still", [](int32_t, int32_t) {
+		return Cam{ivec2(0, 0), 0};
+	}},
+	{"walk", [](int32_t t, int32_t n) {
+		return Cam{ivec2(0, -2000 + 2400 * t / n), 0};
+	}},
+	{"strafe", [](int32_t t, int32_t n) {
+		return Cam{ivec2(-1500 + 3000 * t / n, -1000), 0};
+	}},
+	{"rise", [](int32_t t, int32_t n) {
+		return Cam{ivec2(0, -500), -400 + 800 * t / n};
+	}}
+};
+
+using clock = std::chrono::steady_clock;
+
+// every renderer draws with the textures the demo map names, maps built here use the same ids
+static const std::vector<Texture>& demo_texs(void)
+{
+	static const auto res = [](){
+		Map map;
+		Bsp bsp;
+		if (!mapfile::load("map/demo.sbm", map, bsp))
+			throw std::runtime_error("can't load map/demo.sbm");
+		return map.texs;
+	}();
+	return res;
+}
+
+// the paths walk around the demo map, built along with the bench
+static void set_demo_map(Renderer &r)
+{
+	Map map;
+	Bsp bsp;
+	if (!mapfile::load("map/demo.sbm", map, bsp))
+		throw std::runtime_error("can't load map/demo.sbm");
+	r.set_map(std::move(map), std::move(bsp));
+}
+
+template <bool IsFill>
+static double run_path(Renderer &r, const Path &path, int32_t frames)
+{
+	r.reset_stats();
+	auto bef = clock::now();
+	for (int32_t i = 0; i < frames; i++) {
+		auto c = path.at(i, frames);
+		r.render<IsFill>(c.p, c.ele);
+	}
+	return std::chrono::duration<double>(clock::now() - bef).count();
+}
+
+// n x n square rooms, one sector each, with doors along a random spanning tree so most rooms are hidden
+// ceilings, floors and lights vary from room to room so doors show steps
+static Map maze(int32_t n, uint32_t seed)
+{
+	static constexpr int32_t s = 1800;	// doors are the middle third of a side, keep it exact
+	static constexpr int32_t dx[] = {0, 1, 0, -1};	// up, right, down, left
+	static constexpr int32_t dy[] = {1, 0, -1, 0};
+	std::mt19937 rng(seed);
+	std::vector<uint8_t> doors(n * n);
+	std::vector<bool> visited(n * n);
+	std::vector<int32_t> stack{0};
+	visited[0] = true;
+	while (!stack.empty()) {
+		auto c = stack.back();
+		int32_t next[4], nc = 0;
+		for (int32_t d = 0; d < 4; d++) {
+			int32_t i = c % n + dx[d], j = c / n + dy[d];
+			if (i >= 0 && i < n && j >= 0 && j < n && !visited[j * n + i])
+				next[nc++] = d;
+		}
+		if (nc == 0) {
+			stack.pop_back();
+			continue;
+		}
+		auto d = next[rng() % nc];
+		auto o = (c / n + dy[d]) * n + c % n + dx[d];
+		doors[c] |= 1 << d;
+		doors[o] |= 1 << ((d + 2) % 4);
+		visited[o] = true;
+		stack.push_back(o);
+	}
+
+	Map m;
+	for (int32_t j = 0; j < n; j++)
+		for (int32_t i = 0; i < n; i++) {
+			int32_t lo = -500 - static_cast<int32_t>(rng() % 400);
+			int32_t up = 300 + static_cast<int32_t>(rng() % 300);
+			int32_t light = 128 + static_cast<int32_t>(rng() % 128);
+			Sector sec{static_cast<uint32_t>(m.walls.size()), 0, lo, up, light};
+			ivec2 c[] = {
+				ivec2(i * s, (j + 1) * s),
+				ivec2((i + 1) * s, (j + 1) * s),
+				ivec2((i + 1) * s, j * s),
+				ivec2(i * s, j * s)
+			};
+			for (int32_t d = 0; d < 4; d++) {
+				auto a = c[d];
+				auto b = c[(d + 1) % 4];
+				if (doors[j * n + i] & (1 << d)) {
+					auto t = ivec2((b.x - a.x) / 3, (b.y - a.y) / 3);
+					m.walls.emplace_back(Wall(a, a + t, lo, up));
+					m.walls.emplace_back(Wall(a + t, a + t * 2, lo, up, 0, (j + dy[d]) * n + i + dx[d]));
+					m.walls.emplace_back(Wall(a + t * 2, b, lo, up));
+				} else
+					m.walls.emplace_back(Wall(a, b, lo, up));
+			}
+			sec.count = m.walls.size() - sec.first;
+			m.sectors.emplace_back(sec);
+		}
+	return m;
+}
+
+// walks along the bottom row of growing mazes, the cost should follow what is visible and not the map size
+static void maze_scaling(int32_t frames, int32_t threads)
+{
+	uint32_t w = 640, h = 480;
+	std::vector<uint32_t> fb(w * h);
+	Renderer r(fb.data(), w, h, demo_texs(), threads);
+	std::printf("\n%-8s %10s %10s %14s %14s %10s\n", "maze", "walls", "frames/s", "sectors/frame", "walls/frame",
+		"overdraw");
+	for (int32_t n : {8, 32, 128}) {
+		auto m = maze(n, 1);
+		auto wall_count = m.walls.size();
+		r.set_map(std::move(m));
+		Path path{"maze", [](int32_t t, int32_t f) {
+			return Cam{ivec2(300 + 1800 * 8 * t / f, 900), 0};
+		}};
+		run_path<true>(r, path, min(frames, 16));
+		auto full = run_path<true>(r, path, frames);
+		auto stats = r.stats();
+		char maze_str[32];
+		std::snprintf(maze_str, sizeof(maze_str), "%dx%d", n, n);
+		std::printf("%-8s %10zu %10.1f %14.1f %14.1f %10.2f\n", maze_str, wall_count, frames / full,
+			static_cast<double>(stats.sectors) / frames,
+			static_cast<double>(stats.walls) / frames,
+			static_cast<double>(stats.writes) / frames / (w * h));
+	}
+}
+
+// k x k square pillars facing out, rows staggered so that no line of sight runs far through the field
+// they sit a few units off a regular grid so that the BSP has to split walls
+static Map field(int32_t k, uint32_t seed)
+{
+	static constexpr int32_t s = 1200;	// grid step
+	static constexpr int32_t p = 700;	// pillar side, wider than the gaps of the next row
+	std::mt19937 rng(seed);
+	Map m;
+	for (int32_t j = 0; j < k; j++)
+		for (int32_t i = 0; i < k; i++) {
+			auto o = ivec2(i * s + j % 2 * s / 2 + rng() % 200, j * s + rng() % 200);
+			ivec2 c[] = {
+				o,
+				o + ivec2(0, p),
+				o + ivec2(p, p),
+				o + ivec2(p, 0)
+			};
+			int32_t lo = -500 - static_cast<int32_t>(rng() % 400);
+			for (int32_t d = 0; d < 4; d++)
+				m.walls.emplace_back(Wall(c[(d + 1) % 4], c[d], lo, 500));
+		}
+	return m;
+}
+
+// walks into growing pillar fields, the BSP and the cover should keep the cost close to what is visible
+// the first row is the demo map, load is the same map and BSP back from a binary map
+static void field_scaling(int32_t frames, int32_t threads)
+{
+	uint32_t w = 640, h = 480;
+	std::vector<uint32_t> fb(w * h);
+	Renderer r(fb.data(), w, h, demo_texs(), threads);
+	std::printf("\n%-8s %10s %10s %10s %10s %12s %14s %10s\n", "field", "walls", "build ms", "load ms", "frames/s",
+		"nodes/frame", "walls/frame", "overdraw");
+	auto tmp = (std::filesystem::temp_directory_path() / "sbuild_bench_field.sbm").string();
+	for (int32_t k : {0, 5, 16, 50, 158}) {
+		Map m;
+		Bsp bsp;
+		double build = 0.0;
+		if (k > 0) {
+			m = field(k, 1);
+			auto bef = clock::now();
+			bsp = Bsp(m.walls);
+			build = std::chrono::duration<double>(clock::now() - bef).count();
+		} else if (!mapfile::load("map/demo.sbm", m, bsp))
+			throw std::runtime_error("can't load map/demo.sbm");
+		auto wall_count = m.walls.size();
+		if (!mapfile::save(tmp.c_str(), m, bsp))
+			throw std::runtime_error("can't save " + tmp);
+		auto bef = clock::now();
+		if (!mapfile::load(tmp.c_str(), m, bsp))
+			throw std::runtime_error("can't load " + tmp);
+		auto load = std::chrono::duration<double>(clock::now() - bef).count();
+		std::filesystem::remove(tmp);
+		r.set_map(std::move(m), std::move(bsp));
+		static int32_t lane;
+		lane = k / 2 * 1200 + 900;
+		Path path{"field", [](int32_t t, int32_t f) {
+			return Cam{ivec2(lane, -1000 + 4800 * t / f), 0};
+		}};
+		run_path<true>(r, path, min(frames, 16));
+		auto full = run_path<true>(r, path, frames);
+		auto stats = r.stats();
+		char field_str[32];
+		std::snprintf(field_str, sizeof(field_str), "%dx%d", k, k);
+		std::printf("%-8s %10zu %10.1f %10.1f %10.1f %12.1f %14.1f %10.2f\n", field_str, wall_count, build * 1.0e3,
+			load * 1.0e3, frames / full,
+			static_cast<double>(stats.nodes) / frames,
+			static_cast<double>(stats.walls) / frames,
+			static_cast<double>(stats.writes) / frames / (w * h));
+	}
+}
+
+// the same frames drawn as RGBA then as palette indices, a quarter of the bytes to write and to sample
+static void format_compare(int32_t frames, int32_t threads)
+{
+	std::printf("\n%-10s %-8s %12s %12s\n", "res", "path", "rgba f/s", "indexed f/s");
+	for (auto &res : {resolutions[1], resolutions[4]}) {
+		std::vector<uint32_t> fb(res.w * res.h);
+		std::vector<uint8_t> fb8(res.w * res.h);
+		Renderer r(fb.data(), res.w, res.h, demo_texs(), threads);
+		Renderer r8(fb8.data(), res.w, res.h, demo_texs(), threads, Renderer::Format::indexed);
+		set_demo_map(r);
+		set_demo_map(r8);
+		for (auto &path : paths) {
+			run_path<true>(r, path, min(frames, 16));
+			auto t = run_path<true>(r, path, frames);
+			run_path<true>(r8, path, min(frames, 16));
+			auto t8 = run_path<true>(r8, path, frames);
+			char res_str[32];
+			std::snprintf(res_str, sizeof(res_str), "%ux%u", res.w, res.h);
+			std::printf("%-10s %-8s %12.1f %12.1f\n", res_str, path.name, frames / t, frames / t8);
+		}
+	}
+}
+
+// columns whose signature changes from one frame to the next along the paths, what the display uploads
+static void coherence(int32_t frames)
+{
+	uint32_t w = 640, h = 480;
+	std::vector<uint32_t> fb(w * h);
+	Renderer r(fb.data(), w, h, demo_texs());
+	set_demo_map(r);
+	std::printf("\n%-10s %-8s %16s\n", "res", "path", "changed columns");
+	for (auto &path : paths) {
+		std::vector<uint64_t> prev;
+		uint64_t changed = 0;
+		for (int32_t i = 0; i < frames; i++) {
+			auto c = path.at(i, frames);
+			r.render(c.p, c.ele);
+			auto &sigs = r.signatures();
+			for (uint32_t x = 0; i > 0 && x < w; x++)
+				changed += sigs[x] != prev[x];
+			prev = sigs;
+		}
+		std::printf("%-10s %-8s %15.1f%%\n", "640x480", path.name,
+			frames > 1 ? 100.0 * changed / (static_cast<uint64_t>(frames - 1) * w) : 0.0);
+	}
+}
+
+// reciprocals within their bound and never above, then quotients exactly those of /, on every magnitude
+static bool check_recip(void)
+{
+	std::mt19937_64 rng(1);
+	double err_max = 0.0;
+	size_t above = 0;
+	for (uint64_t m = static_cast<uint64_t>(1) << 31; m >> 32 == 0; m += 251) {
+		auto r = recip::reciprocal(m);
+		auto ref = (static_cast<uint64_t>(1) << 63) / m;
+		above += r > ref;
+		err_max = std::max(err_max, static_cast<double>(ref - r) / ref);
+	}
+	std::printf("%-8s reciprocals: %.2g max relative error, bound %.2g, %zu above\n", "recip", err_max, std::ldexp(1.0, -21),
+		above);
+	size_t bad = 0;
+	int64_t edges[] = {1, -1, 2, 3, 7, 16, 640, INT32_MAX, INT32_MIN, INT64_MAX, INT64_MIN, INT64_MIN + 1};
+	for (auto n : edges)
+		for (auto d : edges)
+			if (!(n == INT64_MIN && d == -1))
+				bad += recip::div(n, d) != n / d;
+	for (size_t it = 0; it < 10000000; it++) {
+		auto n = static_cast<int64_t>(rng()) >> (rng() % 64);
+		auto d = static_cast<int64_t>(rng()) >> (rng() % 64);
+		if (d != 0 && !(n == INT64_MIN && d == -1))
+			bad += recip::div(n, d) != n / d;
+	}
+	std::printf("%-8s random divides: %zu mismatches\n", "recip", bad);
+	return err_max < std::ldexp(1.0, -21) && above == 0 && bad == 0;
+}
+
+// posts of the masked texture against its alpha, texel by texel on every column of every level
+static bool check_posts(void)
+{
+	tex::Store st;
+	st.load({{"res/s0.png", true}});
+	auto &t = st[0];
+	size_t bad = 0;
+	size_t columns = 0;
+	for (uint32_t lod = 0; lod <= t.log2; lod++) {
+		uint32_t size = 1u << (t.log2 - lod);
+		for (uint32_t x = 0; x < size; x++) {
+			auto col = st.column(0, lod, x);
+			std::vector<bool> is_opaque(size);
+			auto [pf, pl] = st.posts(0, lod, x);
+			for (auto p = pf; p != pl; p++)
+				for (uint32_t y = p->first; y < p->first + p->count && y < size; y++)
+					is_opaque[y] = true;
+			for (uint32_t y = 0; y < size; y++)
+				bad += is_opaque[y] != ((col[y] >> 24) >= tex::alpha_min);
+			columns++;
+		}
+	}
+	std::printf("%-8s posts: %zu mismatches over %zu columns\n", "tex", bad, columns);
+	return bad == 0;
+}
+
+// a binary map whose walls, masked walls and sprites name a texture the store lacks loads, and draws exactly as
+// the same map with texture 0 there
+static bool check_bad_texs(void)
+{
+	auto make = [](uint32_t tex){
+		Map m;
+		m.walls.emplace_back(Wall(ivec2(-500, 500), ivec2(2000, 3000), -500, 500, tex));
+		m.walls.emplace_back(Wall(ivec2(-2000, 2500), ivec2(-600, 600), -300, 700, 0));
+		m.masked.emplace_back(Wall(ivec2(-400, 400), ivec2(600, 900), -200, 300, tex));
+		m.sprites.emplace_back(Sprite{ivec2(200, 300), -100, 200, 300, tex, 0});
+		return m;
+	};
+	auto tmp = (std::filesystem::temp_directory_path() / "sbuild_bench_bad_texs.sbm").string();
+	auto m = make(7);
+	Map map;
+	Bsp bsp;
+	bool is_loaded = mapfile::save(tmp.c_str(), m, Bsp(m.walls)) && mapfile::load(tmp.c_str(), map, bsp);
+	std::error_code ec;
+	std::filesystem::remove(tmp, ec);
+	if (!is_loaded) {
+		std::printf("%-8s bad texture ids: can't write or load %s\n", "map", tmp.c_str());
+		return false;
+	}
+	uint32_t w = 320, h = 200;
+	std::vector<uint32_t> fb_ref(w * h), fb(w * h);
+	Renderer r_ref(fb_ref.data(), w, h, demo_texs());
+	Renderer r(fb.data(), w, h, demo_texs());
+	r_ref.set_map(make(0));
+	r.set_map(std::move(map), std::move(bsp));
+	std::mt19937 rng(1);
+	size_t bad = 0;
+	for (size_t it = 0; it < 200; it++) {
+		ivec2 p(rng() % 6000 - 3000, rng() % 2900 - 2500);
+		int32_t ele = rng() % 900 - 450;
+		r_ref.render(p, ele);
+		r.render(p, ele);
+		bad += fb_ref != fb;
+	}
+	std::printf("%-8s bad texture ids: %zu mismatches\n", "map", bad);
+	return bad == 0;
+}
+
+// every kernel this CPU supports against the scalar one, on random wall columns then on whole frames
+static bool check(void)
+{
+	const span::Kernel *ks[span::kernel_max];
+	auto kc = span::kernels(ks);
+	std::mt19937 rng(1);
+	bool ok = check_recip();
+	ok = check_posts() && ok;
+	ok = check_bad_texs() && ok;
+
+	static constexpr uint32_t guard = 0xDEADBEEF;
+	static constexpr int32_t n_max = 2048;
+	std::vector<uint32_t> col(1 << tex::log2_max);
+	for (auto &t : col)
+		t = rng();
+	std::vector<uint32_t> ref(n_max + 1), res(n_max + 1);
+	for (uint32_t k = 1; k < kc; k++) {
+		size_t bad = 0;
+		for (size_t it = 0; it < 100000; it++) {
+			// same ranges as the renderer: tu in [0, h], bu - tu over a column of up to n_max pixels
+			uint32_t l = rng() % span::log2_count;
+			int32_t n = rng() % n_max;
+			int32_t v = (rng() % 256) << 16;
+			int32_t vs = rng() % (1 << 22) - (1 << 20);
+			std::fill(ref.begin(), ref.end(), guard);
+			std::fill(res.begin(), res.end(), guard);
+			uint32_t sc = rng() % 257;
+			span::scalar.fill[l](ref.data(), col.data(), v, vs, n, sc);
+			ks[k]->fill[l](res.data(), col.data(), v, vs, n, sc);
+			if (ref != res)
+				bad++;
+		}
+		std::printf("%-8s random columns: %zu mismatches\n", ks[k]->name, bad);
+		ok = ok && bad == 0;
+	}
+
+	// same on indices, the padding is what the store keeps after its arena
+	std::vector<uint8_t> col8(col.size() + tex::index_pad);
+	for (size_t i = 0; i < col.size(); i++)
+		col8[i] = col[i];
+	std::vector<uint8_t> map(256);
+	for (auto &m : map)
+		m = rng();
+	std::vector<uint8_t> ref8(n_max + 1), res8(n_max + 1);
+	for (uint32_t k = 1; k < kc; k++) {
+		size_t bad = 0;
+		for (size_t it = 0; it < 100000; it++) {
+			uint32_t l = rng() % span::log2_count;
+			int32_t n = rng() % n_max;
+			int32_t v = (rng() % 256) << 16;
+			int32_t vs = rng() % (1 << 22) - (1 << 20);
+			std::fill(ref8.begin(), ref8.end(), 0xA5);
+			std::fill(res8.begin(), res8.end(), 0xA5);
+			// the texture ends right before the padding, so any read past it but within it is allowed
+			auto tex = col8.data() + col.size() - (1u << l);
+			span::scalar.fill8[l](ref8.data(), tex, v, vs, n, map.data());
+			ks[k]->fill8[l](res8.data(), tex, v, vs, n, map.data());
+			if (ref8 != res8)
+				bad++;
+		}
+		std::printf("%-8s random index columns: %zu mismatches\n", ks[k]->name, bad);
+		ok = ok && bad == 0;
+	}
+
+	uint32_t w = 640, h = 480;
+	std::vector<uint32_t> fb_ref(w * h), fb(w * h);
+	Renderer r_ref(fb_ref.data(), w, h, demo_texs());
+	Renderer r(fb.data(), w, h, demo_texs());
+	set_demo_map(r_ref);
+	set_demo_map(r);
+	r_ref.set_kernel(span::scalar);
+	for (uint32_t k = 1; k < kc; k++) {
+		r.set_kernel(*ks[k]);
+		size_t bad = 0;
+		for (size_t it = 0; it < 500; it++) {
+			ivec2 p(rng() % 6000 - 3000, rng() % 2900 - 2500);
+			int32_t ele = rng() % 900 - 450;
+			r_ref.render(p, ele);
+			r.render(p, ele);
+			if (fb_ref != fb)
+				bad++;
+		}
+		std::printf("%-8s random frames: %zu mismatches\n", ks[k]->name, bad);
+		ok = ok && bad == 0;
+	}
+
+	// streamed textures show their placeholders until decoded, then the exact frames of resident ones, a budget of
+	// a byte keeps only what the last frame sampled
+	{
+		std::vector<uint32_t> fb_s(w * h);
+		Renderer rs(fb_s.data(), w, h, demo_texs(), 1, Renderer::Format::rgba, 1);
+		set_demo_map(rs);
+		rs.set_kernel(span::scalar);
+		size_t bad = 0;
+		size_t waited = 0;
+		for (size_t it = 0; it < 200; it++) {
+			ivec2 p(rng() % 6000 - 3000, rng() % 2900 - 2500);
+			int32_t ele = rng() % 900 - 450;
+			r_ref.render(p, ele);
+			rs.render(p, ele);
+			waited += fb_s != fb_ref;
+			rs.wait_textures();
+			rs.render(p, ele);
+			bad += fb_s != fb_ref;
+		}
+		std::printf("%-8s streamed frames: %zu mismatches, %zu frames drawn before their textures\n", "scalar", bad,
+			waited);
+		ok = ok && bad == 0;
+	}
+
+	// equal column signatures on two successive frames must mean equal columns, or a changed column would not be
+	// uploaded
+	{
+		std::vector<uint32_t> prev(w * h);
+		std::vector<uint64_t> prev_sigs(w);
+		size_t bad = 0;
+		size_t same = 0;
+		ivec2 p(0, 0);
+		int32_t ele = 0;
+		for (size_t it = 0; it < 2000; it++) {
+			// small steps around random places, so that successive frames share some of their columns
+			if (it % 16 == 0) {
+				p = ivec2(rng() % 6000 - 3000, rng() % 2900 - 2500);
+				ele = rng() % 900 - 450;
+			} else if (it % 2 == 0)
+				p += ivec2(rng() % 9 - 4, rng() % 9 - 4);
+			r_ref.render(p, ele);
+			auto &sigs = r_ref.signatures();
+			for (uint32_t x = 0; it > 0 && x < w; x++)
+				if (sigs[x] == prev_sigs[x]) {
+					same++;
+					bad += std::memcmp(&fb_ref[x * h], &prev[x * h], h * sizeof(uint32_t)) != 0;
+				}
+			prev = fb_ref;
+			prev_sigs = sigs;
+		}
+		std::printf("%-8s column signatures: %zu mismatches over %zu unchanged columns\n", "scalar", bad, same);
+		ok = ok && bad == 0;
+	}
+
+	std::vector<uint8_t> fb8_ref(w * h), fb8(w * h);
+	Renderer r8_ref(fb8_ref.data(), w, h, demo_texs(), 1, Renderer::Format::indexed);
+	Renderer r8(fb8.data(), w, h, demo_texs(), 1, Renderer::Format::indexed);
+	set_demo_map(r8_ref);
+	set_demo_map(r8);
+	r8_ref.set_kernel(span::scalar);
+	for (uint32_t k = 1; k < kc; k++) {
+		r8.set_kernel(*ks[k]);
+		size_t bad = 0;
+		for (size_t it = 0; it < 500; it++) {
+			ivec2 p(rng() % 6000 - 3000, rng() % 2900 - 2500);
+			int32_t ele = rng() % 900 - 450;
+			r8_ref.render(p, ele);
+			r8.render(p, ele);
+			if (fb8_ref != fb8)
+				bad++;
+		}
+		std::printf("%-8s random indexed frames: %zu mismatches\n", ks[k]->name, bad);
+		ok = ok && bad == 0;
+	}
+	return ok;
+}
+
+// the scripted paths at 640x480 as a trace, to replay against later builds
+static bool record(const char *path)
+{
+	replay::Writer wr;
+	if (!wr.open(path)) {
+		std::printf("can't record to %s\n", path);
+		return false;
+	}
+	uint32_t w = 640, h = 480;
+	std::vector<uint32_t> fb(w * h);
+	Renderer r(fb.data(), w, h, demo_texs());
+	set_demo_map(r);
+	int32_t frames = 200;
+	size_t count = 0;
+	for (auto &path : paths)
+		for (int32_t i = 0; i < frames; i++) {
+			auto c = path.at(i, frames);
+			r.render(c.p, c.ele);
+			wr.write(replay::Frame{c.p, c.ele, w, h, replay::hash(fb.data(), fb.size() * sizeof(uint32_t))});
+			count++;
+		}
+	std::printf("recorded %zu frames to %s\n", count, path);
+	return true;
+}
+
+// renders every frame of a trace at its recorded size, times it and checks its hash
+static bool replay_trace(const char *path, int32_t threads)
+{
+	replay::Reader rd;
+	if (!rd.open(path) || rd.size() == 0) {
+		std::printf("can't replay %s\n", path);
+		return false;
+	}
+	uint32_t w = 1, h = 1;
+	for (size_t i = 0; i < rd.size(); i++) {
+		w = max(w, rd[i].w);
+		h = max(h, rd[i].h);
+	}
+	std::vector<uint32_t> fb(w * h);
+	Renderer r(fb.data(), w, h, demo_texs(), threads);
+	set_demo_map(r);
+	double t = 0.0;
+	size_t bad = 0;
+	for (size_t i = 0; i < rd.size(); i++) {
+		auto f = rd[i];
+		r.set_size(f.w, f.h);
+		auto bef = clock::now();
+		r.render(f.camp, f.camele);
+		t += std::chrono::duration<double>(clock::now() - bef).count();
+		if (replay::hash(fb.data(), static_cast<size_t>(f.w) * f.h * sizeof(uint32_t)) != f.hash) {
+			if (bad == 0)
+				std::printf("frame %zu differs first\n", i);
+			bad++;
+		}
+	}
+	std::printf("replay: %zu frames, %.1f frames/s, %zu hash mismatches\n", rd.size(), rd.size() / t, bad);
+	return bad == 0;
+}
+
+}
+
+int main(int argc, char **argv)
+{
+	if (argc > 1 && std::strcmp(argv[1], "check") == 0) {
+		try {
+			return check() ? 0 : 1;
+		} catch (const std::exception &e) {
+			std::printf("FATAL ERROR: %s\n", e.what());
+			return 1;
+		}
+	}
+	if (argc > 2 && (std::strcmp(argv[1], "record") == 0 || std::strcmp(argv[1], "replay") == 0)) {
+		try {
+			if (std::strcmp(argv[1], "record") == 0)
+				return record(argv[2]) ? 0 : 1;
+			return replay_trace(argv[2], argc > 3 ? max(std::atoi(argv[3]), 1) : 1) ? 0 : 1;
+		} catch (const std::exception &e) {
+			std::printf("FATAL ERROR: %s\n", e.what());
+			return 1;
+		}
+	}
+
+	int32_t frames = argc > 1 ? std::atoi(argv[1]) : 200;
+	int32_t threads = argc > 2 ? std::atoi(argv[2]) : 1;
+	if (frames <= 0 || threads <= 0) {
+		std::printf("usage: %s [frames] [threads]\n       %s check\n       %s record <trace>\n       %s replay <trace> [threads]\n",
+			argv[0], argv[0], argv[0], argv[0]);
+		return 1;
+	}
+	std::printf("threads: %d, span kernel: %s\n", threads, span::best.name);
+
+	std::printf("%-10s %-8s %10s %10s %14s %14s %10s\n", "res", "path", "frames/s", "Mpix/s", "setup ns/wall",
+		"fill ns/pix", "overdraw");
+	try {
+		for (auto &res : resolutions) {
+			std::vector<uint32_t> fb(res.w * res.h);
+			Renderer r(fb.data(), res.w, res.h, demo_texs(), threads);
+			set_demo_map(r);
+			for (auto &path : paths) {
+				run_path<true>(r, path, min(frames, 16));	// warm caches
+				auto full = run_path<true>(r, path, frames);
+				auto stats = r.stats();
+				auto setup = run_path<false>(r, path, frames);
+
+				char res_str[32];
+				std::snprintf(res_str, sizeof(res_str), "%ux%u", res.w, res.h);
+				double walls = stats.walls > 0 ? stats.walls : 1;
+				double pixels = stats.pixels > 0 ? stats.pixels : 1;
+				// overdraw is pixel writes per screen pixel, 1 when every pixel is written exactly once
+				std::printf("%-10s %-8s %10.1f %10.1f %14.1f %14.3f %10.2f\n", res_str, path.name,
+					frames / full,
+					stats.pixels / full * 1.0e-6,
+					setup / walls * 1.0e9,
+					(full - setup) / pixels * 1.0e9,
+					static_cast<double>(stats.writes) / frames / (res.w * res.h));
+			}
+		}
+		maze_scaling(frames, threads);
+		field_scaling(frames, threads);
+		format_compare(frames, threads);
+		coherence(frames);
+	} catch (const std::exception &e) {
+		std::printf("FATAL ERROR: %s\n", e.what());
+		return 1;
+	}
+	return 0;
+}
@@ -103,6 +103,7 @@ struct AllocCreateInfo
 {
 	VmaAllocationCreateFlags flags;
 	VmaMemoryUsage usage;
+	VkMemoryPropertyFlags required_flags;	// on top of what usage implies, 0 for none
 };
 
 struct Allocator
@@ -8,13 +8,13 @@
 
 namespace stb {
 
-/*static uint32_t log2(uint32_t s)
+static uint32_t log2(uint32_t s)
 {
-	for (size_t i = 0; i < 32; i++)
-		if (1 << i == s)
+	for (uint32_t i = 0; i < 32; i++)
+		if (1u << i == s)
 			return i;
-	return 0;
-}*/
+	return 32;
+}
 
 static uint8_t srgb_to_lin(uint8_t val)
 {
@@ -39,28 +39,42 @@ Img::Img(const char *path, bool is_alpha)
 		std::printf("ERR: not squared (w=%d, h=%d)\n", x, y);
 		throw std::runtime_error(path);
 	}
-	if (x != size) {
-		std::printf("ERR: size mismatch (exp=%u, got=%d)\n", size, x);
-		throw std::runtime_error(path);
-	}
-	/*size = x;
-	auto p2 = log2(size);
-	if (1 << p2 != size) {
-		std::printf("ERR: size not pow2 (w=%d, h=%d)\n", x, y);
+	size = x;
+	log2 = stb::log2(size);
+	if (log2 > log2_max) {
+		std::printf("ERR: size not pow2 or too large (w=%d, h=%d, max=%u)\n", x, y, 1u << log2_max);
 		throw std::runtime_error(path);
 	}
-	size_mask = 0;
-	for (size_t i = 0; i < p2; i++)
-		size_mask |= 1 << i;*/
+	size_mask = size - 1;
 
 	size_t c = chan;
-	data = new uint32_t[size * size] {};
+	data = new uint32_t[texel_count()] {};
 	auto udata = reinterpret_cast<uint8_t*>(data);
 	for (size_t i = 0; i < size; i++)
 		for (size_t j = 0; j < size; j++)
-			for (size_t k = 0; k < c; k++)
-				udata[(i * size + j) * sizeof(uint32_t) + k] = srgb_to_lin(img[(j * size + i) * c + k]);
+			for (size_t k = 0; k < c; k++) {
+				auto v = img[(j * size + i) * c + k];
+				// alpha is coverage, not a color, it stays as is
+				udata[(i * size + j) * sizeof(uint32_t) + k] = k < 3 ? srgb_to_lin(v) : v;
+			}
 	stbi_image_free(img);
+
+	// box filter each level from the previous one, channels are already linear
+	for (uint32_t l = 1; l < levels(); l++) {
+		size_t s = size >> l;
+		size_t ps = s * 2;
+		auto src = reinterpret_cast<const uint8_t*>(data + level_offset(log2, l - 1));
+		auto dst = reinterpret_cast<uint8_t*>(data + level_offset(log2, l));
+		for (size_t i = 0; i < s; i++)
+			for (size_t j = 0; j < s; j++)
+				for (size_t k = 0; k < sizeof(uint32_t); k++) {
+					uint32_t sum = src[((i * 2) * ps + j * 2) * sizeof(uint32_t) + k] +
+						src[((i * 2) * ps + j * 2 + 1) * sizeof(uint32_t) + k] +
+						src[((i * 2 + 1) * ps + j * 2) * sizeof(uint32_t) + k] +
+						src[((i * 2 + 1) * ps + j * 2 + 1) * sizeof(uint32_t) + k];
+					dst[(i * s + j) * sizeof(uint32_t) + k] = (sum + 2) / 4;
+				}
+	}
 }
 
 Img::~Img(void)
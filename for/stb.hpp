@@ -1,21 +1,36 @@
 #pragma once
 
 #include <cstdint>
+#include <cstddef>
 
 namespace stb {
 
+// square power of two image with its full mip chain, channels linearized
 struct Img {
-	static constexpr uint32_t size = 128;
-	static constexpr uint32_t size_mask = 0x7F;
-	uint32_t *data;
+	static constexpr uint32_t log2_max = 10;	// 1024x1024
+	uint32_t log2;
+	uint32_t size;
+	uint32_t size_mask;
+	uint32_t *data;	// every level column-major, level l right after level l - 1
+
+	// texel count of levels [0, l) of a 1 << log2 image
+	static constexpr uint32_t level_offset(uint32_t log2, uint32_t l)
+	{
+		return ((4u << (log2 * 2)) - ((4u << (log2 * 2)) >> (l * 2))) / 3;
+	}
 
 	Img(const char *path, bool is_alpha);
 	~Img(void);
 
-	inline uint32_t sample(uint32_t x, uint32_t y)
+	inline uint32_t levels(void) const
+	{
+		return log2 + 1;
+	}
+
+	inline size_t texel_count(void) const
 	{
-		return data[(x & size_mask) * size + (y & size_mask)];
+		return level_offset(log2, levels());
 	}
 };
 
-}
\ No newline at end of file
+}
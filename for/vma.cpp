@@ -19,6 +19,7 @@ static VmaAllocationCreateInfo conv_aci(const AllocCreateInfo &ai)
 	VmaAllocationCreateInfo res{};
 	res.usage = ai.usage;
 	res.flags = ai.flags;
+	res.requiredFlags = ai.required_flags;
 	return res;
 }
 
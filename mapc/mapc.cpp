@@ -0,0 +1,24 @@
+#include "mapfile.hpp"
+#include <chrono>
+#include <cstdio>
+
+// compiles a text map to a binary map, BSP included, so that loading it costs nothing but the copy
+int main(int argc, char **argv)
+{
+	if (argc != 3) {
+		std::printf("usage: %s <text map> <binary map>\n", argv[0]);
+		return 1;
+	}
+	Map map;
+	if (!mapfile::parse(argv[1], map))
+		return 1;
+	auto bef = std::chrono::steady_clock::now();
+	Bsp bsp(map.walls);
+	auto build = std::chrono::duration<double>(std::chrono::steady_clock::now() - bef).count();
+	if (!mapfile::save(argv[2], map, bsp))
+		return 1;
+	std::printf("%s: %zu textures, %zu walls, %zu sectors, %zu masked walls, %zu sprites, %zu BSP nodes over %zu walls, "
+		"built in %.1f ms\n", argv[2], map.texs.size(), map.walls.size(), map.sectors.size(), map.masked.size(), map.sprites.size(), bsp.nodes().size(),
+		bsp.walls().size(), build * 1.0e3);
+	return 0;
+}
@@ -9,9 +9,26 @@ layout(set = 0, binding = 0) readonly buffer Sp {
 	uint8_t fb[];
 } s;
 
+// indexed frames hold a byte per pixel, looked up in the palette
+layout(constant_id = 0) const bool is_indexed = false;
+
+layout(set = 0, binding = 1) readonly buffer Pal {
+	uint colors[256];
+} pal;
+
+// the samples hold a size.x by size.y frame, stretched over the extent.x by extent.y swapchain image
+layout(push_constant) uniform Pc {
+	uvec2 size;
+	uvec2 extent;
+} pc;
+
 void main(void)
 {
-	uvec2 p = uvec2(gl_FragCoord.xy);
-	uint off = (p.x * s.h + p.y) * 4;
-	o = vec3(uvec3(s.fb[off + 0], s.fb[off + 1], s.fb[off + 2])) / 255.0;
+	uvec2 p = uvec2(gl_FragCoord.xy) * pc.size / pc.extent;
+	uint off = p.x * s.h + p.y;
+	if (is_indexed) {
+		uint c = pal.colors[uint(s.fb[off])];
+		o = vec3(uvec3(c, c >> 8, c >> 16) & 0xFFu) / 255.0;
+	} else
+		o = vec3(uvec3(s.fb[off * 4 + 0], s.fb[off * 4 + 1], s.fb[off * 4 + 2])) / 255.0;
 }
\ No newline at end of file
@@ -0,0 +1,30 @@
+#version 460
+#extension GL_GOOGLE_include_directive : enable
+
+layout(location = 0) out vec3 o;
+
+// samples copied as is: one image row per screen column
+layout(set = 0, binding = 0) uniform sampler2D s;
+
+// indexed frames are copied into a single channel image, looked up in the palette
+layout(constant_id = 0) const bool is_indexed = false;
+
+layout(set = 0, binding = 1) readonly buffer Pal {
+	uint colors[256];
+} pal;
+
+// the samples hold a size.x by size.y frame, stretched over the extent.x by extent.y swapchain image
+layout(push_constant) uniform Pc {
+	uvec2 size;
+	uvec2 extent;
+} pc;
+
+void main(void)
+{
+	ivec2 p = ivec2(uvec2(gl_FragCoord.xy) * pc.size / pc.extent);
+	if (is_indexed) {
+		uint c = pal.colors[uint(texelFetch(s, p.yx, 0).r * 255.0 + 0.5)];
+		o = vec3(uvec3(c, c >> 8, c >> 16) & 0xFFu) / 255.0;
+	} else
+		o = texelFetch(s, p.yx, 0).rgb;
+}
\ No newline at end of file
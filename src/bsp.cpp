@@ -0,0 +1,131 @@
+#include "bsp.hpp"
+#include <limits>
+#include <utility>
+
+namespace {
+
+static constexpr size_t candidate_max = 16;	// splitters tried per node, spread over its walls
+static constexpr int64_t split_cost = 8;	// a split costs as much as this much imbalance
+
+// the wall among a few candidates cutting the fewest others, then splitting the set the most evenly
+static size_t pick(const std::vector<Wall> &ws)
+{
+	size_t res = 0;
+	int64_t res_cost = std::numeric_limits<int64_t>::max();
+	size_t step = ws.size() / candidate_max + 1;
+	for (size_t c = 0; c < ws.size(); c += step) {
+		auto &sp = ws[c];
+		int64_t front = 0;
+		int64_t back = 0;
+		int64_t splits = 0;
+		for (auto &w : ws) {
+			auto sa = Wall::side(sp.a, sp.b, w.a);
+			auto sb = Wall::side(sp.a, sp.b, w.b);
+			if (sa >= 0 && sb >= 0)
+				front += sa != 0 || sb != 0;
+			else if (sa <= 0 && sb <= 0)
+				back++;
+			else
+				splits++;
+		}
+		auto cost = splits * split_cost + (front > back ? front - back : back - front);
+		if (cost < res_cost) {
+			res = c;
+			res_cost = cost;
+		}
+	}
+	return res;
+}
+
+static void extend(Bsp::Box &box, const ivec2 &p)
+{
+	box.min = ivec2(min(box.min.x, p.x), min(box.min.y, p.y));
+	box.max = ivec2(max(box.max.x, p.x), max(box.max.y, p.y));
+}
+
+}
+
+Bsp::Bsp(const std::vector<Wall> &walls)
+{
+	// iterative so that degenerate wall sets cannot overflow the stack, a node is pushed before its children
+	struct Job {
+		std::vector<Wall> walls;
+		int32_t parent;
+		bool is_front;
+	};
+	std::vector<Job> jobs;
+	{
+		Job root{{}, -1, false};
+		for (auto &w : walls)
+			if (w.a.x != w.b.x || w.a.y != w.b.y)
+				root.walls.emplace_back(w);
+		if (root.walls.empty())
+			return;
+		jobs.emplace_back(std::move(root));
+	}
+	while (!jobs.empty()) {
+		auto job = std::move(jobs.back());
+		jobs.pop_back();
+		auto sp = job.walls[pick(job.walls)];
+		std::vector<Wall> front, back;
+		uint32_t first = m_walls.size();
+		for (auto &w : job.walls) {
+			auto sa = Wall::side(sp.a, sp.b, w.a);
+			auto sb = Wall::side(sp.a, sp.b, w.b);
+			if (sa == 0 && sb == 0)
+				m_walls.emplace_back(w);
+			else if (sa >= 0 && sb >= 0)
+				front.emplace_back(w);
+			else if (sa <= 0 && sb <= 0)
+				back.emplace_back(w);
+			else {
+				// cut at the splitter, the texture carries on from one piece to the other
+				auto d = w.b - w.a;
+				ivec2 p(w.a.x + static_cast<int32_t>(d.x * sa / (sa - sb)),
+					w.a.y + static_cast<int32_t>(d.y * sa / (sa - sb)));
+				auto &to_a = sa > 0 ? front : back;
+				auto &to_b = sa > 0 ? back : front;
+				if (p.x == w.a.x && p.y == w.a.y)
+					to_b.emplace_back(w);
+				else if (p.x == w.b.x && p.y == w.b.y)
+					to_a.emplace_back(w);
+				else {
+					int32_t pu = static_cast<int64_t>(w.w) * sa / (sa - sb);
+					auto wa = w;
+					wa.b = p;
+					wa.w = pu;
+					auto wb = w;
+					wb.a = p;
+					wb.u = (w.u + pu) % tex::ref_size;
+					wb.w = w.w - pu;
+					to_a.emplace_back(wa);
+					to_b.emplace_back(wb);
+				}
+			}
+		}
+
+		int32_t n = m_nodes.size();
+		m_nodes.emplace_back(Node{sp.a, sp.b, -1, -1, first, static_cast<uint32_t>(m_walls.size()) - first,
+			Box{sp.a, sp.a}});
+		if (job.parent >= 0)
+			(job.is_front ? m_nodes[job.parent].front : m_nodes[job.parent].back) = n;
+		if (!back.empty())
+			jobs.emplace_back(Job{std::move(back), n, false});
+		if (!front.empty())
+			jobs.emplace_back(Job{std::move(front), n, true});
+	}
+
+	// children come after their parent, so boxes are done bottom up in reverse order
+	for (size_t i = m_nodes.size(); i-- > 0;) {
+		auto &n = m_nodes[i];
+		for (uint32_t j = 0; j < n.count; j++) {
+			extend(n.box, m_walls[n.first + j].a);
+			extend(n.box, m_walls[n.first + j].b);
+		}
+		for (auto c : {n.front, n.back})
+			if (c >= 0) {
+				extend(n.box, m_nodes[c].box.min);
+				extend(n.box, m_nodes[c].box.max);
+			}
+	}
+}
@@ -0,0 +1,57 @@
+#pragma once
+
+#include "map.hpp"
+#include <cstdint>
+#include <vector>
+#include <utility>
+
+// 2D BSP over a wall set, walls crossing a splitter line are cut in two
+// a node keeps the walls lying on its splitter, its front subtree holds what is in front of the splitter
+class Bsp
+{
+public:
+	struct Box {
+		ivec2 min;
+		ivec2 max;
+	};
+
+	struct Node {
+		ivec2 a;	// splitter line, in front where Wall::side(a, b, p) > 0
+		ivec2 b;
+		int32_t front;	// child nodes, -1 when empty
+		int32_t back;
+		uint32_t first;	// walls on the splitter are walls()[first, first + count)
+		uint32_t count;
+		Box box;	// bounds of every wall of the subtree
+	};
+
+	Bsp(void) = default;
+	explicit Bsp(const std::vector<Wall> &walls);
+
+	// a tree compiled earlier, as given by walls() and nodes()
+	Bsp(std::vector<Wall> walls, std::vector<Node> nodes) :
+		m_walls(std::move(walls)),
+		m_nodes(std::move(nodes))
+	{
+	}
+
+	const std::vector<Wall>& walls(void) const
+	{
+		return m_walls;
+	}
+
+	// root is nodes()[0]
+	const std::vector<Node>& nodes(void) const
+	{
+		return m_nodes;
+	}
+
+	bool empty(void) const
+	{
+		return m_nodes.empty();
+	}
+
+private:
+	std::vector<Wall> m_walls;
+	std::vector<Node> m_nodes;
+};
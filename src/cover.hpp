@@ -0,0 +1,70 @@
+#pragma once
+
+#include <cstdint>
+#include <vector>
+#include <algorithm>
+
+// screen columns already closed by a solid wall, as sorted and merged [l, r) ranges
+// walls come front to back, so whatever part of a wall falls in a closed range is hidden
+class Cover
+{
+	struct Range {
+		int32_t l;
+		int32_t r;
+	};
+
+	std::vector<Range> m_ranges;
+	int32_t m_w = 0;
+
+	// first range ending at or after x
+	auto after(int32_t x) const
+	{
+		return std::lower_bound(m_ranges.begin(), m_ranges.end(), x, [](const Range &r, int32_t x){
+			return r.r < x;
+		});
+	}
+
+public:
+	void reset(int32_t w)
+	{
+		m_w = w;
+		m_ranges.clear();
+	}
+
+	bool is_full(void) const
+	{
+		return m_ranges.size() == 1 && m_ranges[0].l <= 0 && m_ranges[0].r >= m_w;
+	}
+
+	// whether every column of [l, r) is closed
+	bool is_closed(int32_t l, int32_t r) const
+	{
+		auto it = after(l + 1);
+		return it != m_ranges.end() && it->l <= l && it->r >= r;
+	}
+
+	// calls fn(l, r) for every open part of [l, r), left to right
+	template <typename F>
+	void for_open(int32_t l, int32_t r, F &&fn) const
+	{
+		int32_t c = l;
+		for (auto it = after(l + 1); it != m_ranges.end() && it->l < r; it++) {
+			if (it->l > c)
+				fn(c, it->l);
+			c = std::max(c, it->r);
+		}
+		if (c < r)
+			fn(c, r);
+	}
+
+	void close(int32_t l, int32_t r)
+	{
+		auto b = after(l);
+		auto e = b;
+		for (; e != m_ranges.end() && e->l <= r; e++) {
+			l = std::min(l, e->l);
+			r = std::max(r, e->r);
+		}
+		m_ranges.insert(m_ranges.erase(b, e), Range{l, r});
+	}
+};
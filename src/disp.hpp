@@ -5,16 +5,32 @@
 #include <portaudio.h>
 #include <cstdio>
 #include <cstring>
+#include <cstdlib>
+#include <cmath>
 #include <chrono>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <deque>
+#include <future>
+#include <memory>
+#include <string>
+#include <vector>
+#include <filesystem>
+#include <system_error>
 #include "fr.hpp"
 #include "renderer.hpp"
+#include "mapfile.hpp"
+#include "prof.hpp"
+#include "replay.hpp"
+#include "file.hpp"
 
 class Disp
 {
 	GLFWwindow *m_window;
 
 	VkInstance m_instance;
-	VkDebugUtilsMessengerEXT m_debug_callback;
+	VkDebugUtilsMessengerEXT m_debug_callback;	// null unless SBUILD_VALIDATION
 	VkSurfaceKHR m_surface;
 	VkPhysicalDevice m_physical_device;
 	uint32_t m_queue_family;
@@ -32,32 +48,65 @@ class Disp
 	VkDescriptorSetLayout m_descriptor_set_layout;
 	VkPipelineLayout m_pipeline_layout;
 	VkPipeline m_pipeline;
+	// SBUILD_PIPELINE_CACHE, res/pipeline.cache by default, loaded before the pipeline is built and written back on
+	// exit, so that later launches skip the shader compilation of the driver
+	const char *m_pipeline_cache_path;
+	VkPipelineCache m_pipeline_cache;
 
 	VkDescriptorPool m_descriptor_pool;
 	VkCommandPool m_command_pool;
 
 	fr::BufferAllocation m_fullscreen_vertex;
+	fr::BufferAllocation m_palette;	// 256 RGBA colors read by indexed frames
+	// swapchain image
 	struct Frame {
-		VkCommandBuffer cmd_trans;
-		VkCommandBuffer cmd;
-		VkDescriptorSet desc_set;
-		fr::BufferAllocation samples;
-		fr::BufferAllocation samples_stg;
-		void *samples_stg_ptr;
 		VkImage img;
 		VkImageView img_view;
 		VkFramebuffer framebuffer;
-		VkSemaphore samples_ready;
-		VkSemaphore img_ready;
 		VkSemaphore img_rendered;
-		VkFence img_rendered_fence;
-		bool ever_submitted = false;
 	};
 
 	static inline constexpr uint32_t frame_max = 16;
 	Frame m_frames[frame_max];
 	uint32_t m_frame_count;
 
+	struct Columns {
+		uint32_t first;
+		uint32_t count;
+	};
+
+	// one software frame in flight: its samples and everything needed to present them
+	// the render thread fills slots in ring order, a slot is free again once it is submitted and its fence signaled
+	struct Slot {
+		VkCommandBuffer cmd_trans;
+		VkCommandBuffer cmd;
+		VkDescriptorSet desc_set;
+		fr::BufferAllocation samples;
+		fr::BufferAllocation samples_stg;	// unused when samples is mapped
+		void *samples_ptr;	// the renderer draws right there: samples when mapped, samples_stg otherwise
+		fr::ImageAllocation samples_img;	// image present only, samples copied as an h by w image
+		VkImageView samples_view;
+		VkSemaphore samples_ready;
+		VkSemaphore img_ready;
+		VkFence fence;	// created signaled, then signaled whenever the GPU is done with the slot
+		std::chrono::steady_clock::time_point input_time;	// when the camera it shows was sampled
+		uint32_t w;	// render size of the samples, at most the swapchain extent
+		uint32_t h;
+		bool is_timed;	// its last submit wrote GPU timestamps not read yet
+		// the samples keep the frame last drawn there, a slot asked for the same view again is not redrawn and
+		// only the columns whose signature changed since are uploaded
+		bool is_drawn;	// view and sigs are those of the frame held
+		Renderer::View view;
+		std::vector<uint64_t> sigs;
+		bool is_redrawn;	// by the render thread for this present
+		std::vector<Columns> dirty;	// columns to upload for this present, none when nothing changed
+		bool is_img_valid;	// image present: the image holds an earlier upload, in shader read layout
+	};
+
+	static inline constexpr uint32_t slot_max = 8;
+	Slot m_slots[slot_max];
+	uint32_t m_slot_count;	// queue depth, SBUILD_QUEUE_DEPTH
+
 	static void vkAssert(VkResult res)
 	{
 		if (res != VK_SUCCESS) {
@@ -139,9 +188,10 @@ class Disp
 		vkDestroy(vkDestroySemaphore, sem);
 	}
 
-	VkFence createFence(void)
+	VkFence createFence(VkFenceCreateFlags flags = 0)
 	{
 		VkFenceCreateInfo ci{ .sType = VK_STRUCTURE_TYPE_FENCE_CREATE_INFO };
+		ci.flags = flags;
 		return vkCreate(vkCreateFence, ci);
 	}
 
@@ -167,6 +217,66 @@ class Disp
 		return res;
 	}
 
+	static bool hasInstanceLayer(const char *name)
+	{
+		uint32_t c;
+		if (vkEnumerateInstanceLayerProperties(&c, nullptr) != VK_SUCCESS)
+			return false;
+		std::vector<VkLayerProperties> layers(c);
+		if (vkEnumerateInstanceLayerProperties(&c, layers.data()) != VK_SUCCESS)
+			return false;
+		for (uint32_t i = 0; i < c; i++)
+			if (std::strcmp(layers[i].layerName, name) == 0)
+				return true;
+		return false;
+	}
+
+	// seeded with the cache file when it was written by this very device and driver, drivers are not all trusted to
+	// reject a foreign one themselves
+	VkPipelineCache createPipelineCache(bool &is_warm)
+	{
+		VkPipelineCacheCreateInfo ci{ .sType = VK_STRUCTURE_TYPE_PIPELINE_CACHE_CREATE_INFO };
+		MappedFile file;
+		is_warm = false;
+		VkPipelineCacheHeaderVersionOne h;
+		if (file.open(m_pipeline_cache_path) && file.size() >= sizeof(h)) {
+			std::memcpy(&h, file.data(), sizeof(h));
+			VkPhysicalDeviceProperties props;
+			vkGetPhysicalDeviceProperties(m_physical_device, &props);
+			is_warm = h.headerSize >= sizeof(h) && h.headerVersion == VK_PIPELINE_CACHE_HEADER_VERSION_ONE &&
+				h.vendorID == props.vendorID && h.deviceID == props.deviceID &&
+				std::memcmp(h.pipelineCacheUUID, props.pipelineCacheUUID, VK_UUID_SIZE) == 0;
+			if (is_warm) {
+				ci.initialDataSize = file.size();
+				ci.pInitialData = file.data();
+			} else
+				std::printf("WARN: %s is from another device or driver, rebuilding it\n", m_pipeline_cache_path);
+		}
+		return vkCreate(vkCreatePipelineCache, ci);
+	}
+
+	// written aside then renamed, so that an interrupted write leaves the previous cache
+	void savePipelineCache(void)
+	{
+		size_t size;
+		if (vkGetPipelineCacheData(m_device, m_pipeline_cache, &size, nullptr) != VK_SUCCESS || size == 0)
+			return;
+		std::vector<uint8_t> data(size);
+		if (vkGetPipelineCacheData(m_device, m_pipeline_cache, &size, data.data()) != VK_SUCCESS)
+			return;
+		std::string tmp = std::string(m_pipeline_cache_path) + ".tmp";
+		auto file = std::fopen(tmp.c_str(), "wb");
+		bool ok = file != nullptr && std::fwrite(data.data(), 1, size, file) == size;
+		ok = file != nullptr && std::fclose(file) == 0 && ok;
+		std::error_code ec;
+		if (ok)
+			std::filesystem::rename(tmp, m_pipeline_cache_path, ec);
+		if (!ok || ec) {
+			std::printf("WARN: can't write pipeline cache %s\n", m_pipeline_cache_path);
+			std::filesystem::remove(tmp, ec);
+		}
+	}
+
 	void transferSync(VkBuffer buffer, size_t size, const void *data)
 	{
 		VkBufferCreateInfo ci{ .sType = VK_STRUCTURE_TYPE_BUFFER_CREATE_INFO };
@@ -181,7 +291,7 @@ class Disp
 		std::memcpy(mapped, data, size);
 		m_allocator.flushAllocation(stag.allocation, 0, size);	// flush device cache to make visible data
 
-		auto cmd = m_frames[0].cmd;
+		auto cmd = m_slots[0].cmd;
 		{
 			VkCommandBufferBeginInfo bi{ .sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_BEGIN_INFO};
 			vkAssert(vkBeginCommandBuffer(cmd, &bi));
@@ -204,10 +314,391 @@ class Disp
 	}
 
 	size_t fb_size;
+	// the renderer writes samples itself, so frames skip the staging copy
+	// device local memory the CPU can write to for the buffer present, any host memory for the image present
+	bool m_is_samples_mapped;
+	// SBUILD_PRESENT, image copies the samples into an image sampled by sha/img.frag, buffer has sha/base.frag read them bytewise
+	bool m_is_present_image;
+	VkSampler m_sampler;	// image present only
+	// SBUILD_FORMAT=indexed renders palette indices, a byte per pixel, and the fragment shader looks their colors up
+	bool m_is_indexed;
+
+	size_t pxSize(void) const
+	{
+		return m_is_indexed ? sizeof(uint8_t) : sizeof(uint32_t);
+	}
+
+	VkFormat samplesFormat(void) const
+	{
+		return m_is_indexed ? VK_FORMAT_R8_UNORM : VK_FORMAT_R8G8B8A8_UNORM;
+	}
+
+	// GPU time from the upload to the end of the draw, two timestamps per slot, null when the queue can't time
+	VkQueryPool m_query_pool;
+	uint64_t m_timestamp_mask;
+	double m_timestamp_period;	// in ns
+
+	bool hasMemoryType(VkMemoryPropertyFlags flags)
+	{
+		VkPhysicalDeviceMemoryProperties props;
+		vkGetPhysicalDeviceMemoryProperties(m_physical_device, &props);
+		for (uint32_t i = 0; i < props.memoryTypeCount; i++)
+			if ((props.memoryTypes[i].propertyFlags & flags) == flags)
+				return true;
+		return false;
+	}
+
+	// the samples are column major, so they copy as is into an image with one row per screen column
+	fr::ImageAllocation createSamplesImage(void)
+	{
+		VkImageCreateInfo ci{ .sType = VK_STRUCTURE_TYPE_IMAGE_CREATE_INFO };
+		ci.imageType = VK_IMAGE_TYPE_2D;
+		ci.format = samplesFormat();
+		ci.extent = VkExtent3D{m_surface_capabilities.currentExtent.height, m_surface_capabilities.currentExtent.width, 1};
+		ci.mipLevels = 1;
+		ci.arrayLayers = 1;
+		ci.samples = VK_SAMPLE_COUNT_1_BIT;
+		ci.tiling = VK_IMAGE_TILING_OPTIMAL;
+		ci.usage = VK_IMAGE_USAGE_TRANSFER_DST_BIT | VK_IMAGE_USAGE_SAMPLED_BIT;
+		ci.sharingMode = VK_SHARING_MODE_EXCLUSIVE;
+		ci.initialLayout = VK_IMAGE_LAYOUT_UNDEFINED;
+		fr::AllocCreateInfo ai{};
+		ai.usage = VMA_MEMORY_USAGE_GPU_ONLY;
+		return m_allocator.createImage(ci, ai);
+	}
+
+	VkImageView createSamplesView(VkImage img)
+	{
+		VkImageViewCreateInfo ci{ .sType = VK_STRUCTURE_TYPE_IMAGE_VIEW_CREATE_INFO };
+		ci.image = img;
+		ci.viewType = VK_IMAGE_VIEW_TYPE_2D;
+		ci.format = samplesFormat();
+		ci.components.r = VK_COMPONENT_SWIZZLE_IDENTITY;
+		ci.components.g = VK_COMPONENT_SWIZZLE_IDENTITY;
+		ci.components.b = VK_COMPONENT_SWIZZLE_IDENTITY;
+		ci.components.a = VK_COMPONENT_SWIZZLE_IDENTITY;
+		ci.subresourceRange.aspectMask = VK_IMAGE_ASPECT_COLOR_BIT;
+		ci.subresourceRange.baseMipLevel = 0;
+		ci.subresourceRange.levelCount = 1;
+		ci.subresourceRange.baseArrayLayer = 0;
+		ci.subresourceRange.layerCount = 1;
+		return vkCreate(vkCreateImageView, ci);
+	}
+
+	// dirty columns of the samples buffer to image, past the column height, leaving the image ready for the fragment
+	// shader, every image row is a column
+	void copySamplesToImage(Slot &slot)
+	{
+		VkImageMemoryBarrier b{ .sType = VK_STRUCTURE_TYPE_IMAGE_MEMORY_BARRIER };
+		b.srcQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
+		b.dstQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
+		b.image = slot.samples_img.image;
+		b.subresourceRange = VkImageSubresourceRange{VK_IMAGE_ASPECT_COLOR_BIT, 0, 1, 0, 1};
+		// the slot fence was waited for, reads of the previous upload are over, whose clean columns are kept
+		b.srcAccessMask = 0;
+		b.dstAccessMask = VK_ACCESS_TRANSFER_WRITE_BIT;
+		b.oldLayout = slot.is_img_valid ? VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL : VK_IMAGE_LAYOUT_UNDEFINED;
+		b.newLayout = VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL;
+		vkCmdPipelineBarrier(slot.cmd, VK_PIPELINE_STAGE_TOP_OF_PIPE_BIT, VK_PIPELINE_STAGE_TRANSFER_BIT, 0,
+			0, nullptr, 0, nullptr, 1, &b);
+		m_image_copies.clear();
+		for (auto &c : slot.dirty)
+			m_image_copies.emplace_back(VkBufferImageCopy{
+				.bufferOffset = sizeof(uint32_t) + static_cast<VkDeviceSize>(c.first) * slot.h * pxSize(),
+				.bufferRowLength = 0,
+				.bufferImageHeight = 0,
+				.imageSubresource = VkImageSubresourceLayers{VK_IMAGE_ASPECT_COLOR_BIT, 0, 0, 1},
+				.imageOffset = VkOffset3D{0, static_cast<int32_t>(c.first), 0},
+				.imageExtent = VkExtent3D{slot.h, c.count, 1}
+			});
+		vkCmdCopyBufferToImage(slot.cmd, slot.samples.buffer, slot.samples_img.image, VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL,
+			m_image_copies.size(), m_image_copies.data());
+		slot.is_img_valid = true;
+		b.srcAccessMask = VK_ACCESS_TRANSFER_WRITE_BIT;
+		b.dstAccessMask = VK_ACCESS_SHADER_READ_BIT;
+		b.oldLayout = VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL;
+		b.newLayout = VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL;
+		vkCmdPipelineBarrier(slot.cmd, VK_PIPELINE_STAGE_TRANSFER_BIT, VK_PIPELINE_STAGE_FRAGMENT_SHADER_BIT, 0,
+			0, nullptr, 0, nullptr, 1, &b);
+	}
+
+	VkDescriptorType samplesDescriptorType(void) const
+	{
+		return m_is_present_image ? VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER : VK_DESCRIPTOR_TYPE_STORAGE_BUFFER;
+	}
+
+	static void* fbData(const Slot &s)
+	{
+		return static_cast<uint8_t*>(s.samples_ptr) + sizeof(uint32_t);	// past the column height
+	}
+
+	// bytes of the samples buffer holding the last frame, fb_size at full size
+	size_t samplesSize(const Slot &s) const
+	{
+		return sizeof(uint32_t) + static_cast<size_t>(s.w) * s.h * pxSize();
+	}
+
+	// bytes of the samples buffer holding columns c, the column height along with the first column
+	VkBufferCopy samplesRange(const Slot &s, Columns c) const
+	{
+		size_t col = static_cast<size_t>(s.h) * pxSize();
+		VkDeviceSize first = c.first == 0 ? 0 : sizeof(uint32_t) + c.first * col;
+		VkDeviceSize end = sizeof(uint32_t) + (c.first + c.count) * col;
+		return VkBufferCopy{first, first, end - first};
+	}
+
+	// columns whose signature differs from the frame the slot held, every column when is_all
+	// gaps of a few clean columns are uploaded anyway, each range is one more copy region
+	static void findDirty(Slot &slot, const std::vector<uint64_t> &sigs, bool is_all)
+	{
+		static constexpr uint32_t gap_max = 8;
+
+		slot.dirty.clear();
+		slot.sigs.resize(slot.w);
+		for (uint32_t x = 0; x < slot.w; x++) {
+			if (!is_all && sigs[x] == slot.sigs[x])
+				continue;
+			slot.sigs[x] = sigs[x];
+			if (!slot.dirty.empty() && x - (slot.dirty.back().first + slot.dirty.back().count) <= gap_max)
+				slot.dirty.back().count = x + 1 - slot.dirty.back().first;
+			else
+				slot.dirty.emplace_back(Columns{x, 1});
+		}
+	}
+
+	std::vector<VkBufferCopy> m_buffer_copies;	// of the present being recorded
+	std::vector<VkBufferImageCopy> m_image_copies;
+
+	// camera state handed from the input loop to the render thread
+	struct Input {
+		ivec2 camp;
+		int32_t camele;
+		std::chrono::steady_clock::time_point time;
+	};
+
+	std::mutex m_mtx;
+	std::condition_variable m_cv;
+	Input m_input{ivec2(0, 0), 0, {}};
+	std::deque<uint32_t> m_ready;	// rendered slots, oldest first
+	uint32_t m_free;	// slots the render thread may take: never taken yet or already submitted
+	bool m_quit;
+
+	// render size controller, trades resolution to keep the render time of a frame within budget
+	// fill dominates, so the pixel count is scaled by budget / render time
+	struct Scaler {
+		static inline constexpr double min_scale = 0.25;
+
+		double budget;	// in s, 0 always renders at full size
+		double scale = 1.0;	// of both dimensions
+
+		void update(double t)
+		{
+			if (budget <= 0.0 || t <= 0.0)
+				return;
+			auto r = budget / t;
+			if (r > 0.9 && r < 1.1)	// dead band, render times jitter
+				return;
+			// half way only, scale^2 ~ pixel count ~ render time
+			scale = clamp(scale * std::pow(r, 0.25), min_scale, 1.0);
+		}
+	};
+	double m_frame_budget;	// SBUILD_FRAME_BUDGET
+
+	// SBUILD_RECORD writes the camera, render size and hash of every rendered frame
+	// SBUILD_REPLAY renders the frames of such a trace instead of following the keyboard, and checks their hashes
+	replay::Writer m_record;
+	replay::Reader m_replay;
+	bool m_is_replaying;
+	size_t m_replay_frame;
+	size_t m_replay_mismatches;
+
+	// the renderer is built, its textures decoded or mapped and the map loaded, on a thread of its own started
+	// before anything else, so that this overlaps the Vulkan startup, run takes it over
+	std::future<std::unique_ptr<Renderer>> m_loading;
+	std::chrono::steady_clock::time_point m_start;	// of the Disp construction, time to first frame counts from it
+	double m_init_time;	// in s, of the Disp construction
+	double m_load_time;	// in s, of the loading thread, set before m_loading is ready
+
+	void quit(void)
+	{
+		{
+			std::lock_guard l(m_mtx);
+			m_quit = true;
+		}
+		m_cv.notify_all();
+	}
+
+	// rasterizes into the slots in ring order while the input loop submits and presents the previous ones
+	void renderLoop(Renderer &renderer)
+	{
+		uint32_t ew = m_surface_capabilities.currentExtent.width;
+		uint32_t eh = m_surface_capabilities.currentExtent.height;
+		Scaler scaler{m_frame_budget};
+		try {
+			for (uint32_t s = 0;; s = (s + 1) % m_slot_count) {
+				Input in{ivec2(0, 0), 0, {}};
+				{
+					std::unique_lock l(m_mtx);
+					m_cv.wait(l, [&](){
+						return m_quit || m_free > 0;
+					});
+					if (m_quit)
+						return;
+					m_free--;
+					in = m_input;
+				}
+				auto &slot = m_slots[s];
+				// a submitted slot is only free to write once the GPU is done reading it
+				{
+					prof::Scope scope(prof::Stage::fence);
+					vkAssert(vkWaitForFences(m_device, 1, &slot.fence, VK_TRUE, ~0ULL));
+				}
+				if (m_is_replaying) {
+					if (m_replay_frame == m_replay.size()) {
+						quit();
+						return;
+					}
+					// a trace recorded in a larger window can't fit, its frames come out cropped and mismatch
+					auto f = m_replay[m_replay_frame];
+					in.camp = f.camp;
+					in.camele = f.camele;
+					slot.w = clamp(f.w, static_cast<uint32_t>(1), ew);
+					slot.h = clamp(f.h, static_cast<uint32_t>(1), eh);
+				} else {
+					slot.w = max(static_cast<uint32_t>(ew * scaler.scale), min(ew, static_cast<uint32_t>(16)));
+					slot.h = max(static_cast<uint32_t>(eh * scaler.scale), min(eh, static_cast<uint32_t>(16)));
+				}
+				*static_cast<uint32_t*>(slot.samples_ptr) = slot.h;	// column height read by base.frag
+				renderer.set_fb(fbData(slot));
+				renderer.set_size(slot.w, slot.h);
+				auto view = renderer.view(in.camp, in.camele);
+				slot.is_redrawn = !slot.is_drawn || !(slot.view == view);
+				if (slot.is_redrawn) {
+					auto bef = std::chrono::steady_clock::now();
+					renderer.render(in.camp, in.camele);
+					scaler.update(std::chrono::duration<double>(std::chrono::steady_clock::now() - bef).count());
+					// a column signature only holds at a same height, and the column height is uploaded along
+					findDirty(slot, renderer.signatures(), !slot.is_drawn || slot.view.w != slot.w || slot.view.h != slot.h);
+					slot.view = view;
+					slot.is_drawn = true;
+				} else
+					slot.dirty.clear();
+				if (m_is_replaying || m_record.is_open()) {
+					auto h = replay::hash(fbData(slot), static_cast<size_t>(slot.w) * slot.h * pxSize());
+					if (m_is_replaying)
+						m_replay_mismatches += h != m_replay[m_replay_frame++].hash;
+					else
+						m_record.write(replay::Frame{in.camp, in.camele, slot.w, slot.h, h});
+				}
+				{
+					prof::Scope scope(prof::Stage::flush);
+					// flush device cache to make visible samples, clean columns hold the bytes the device already has
+					auto &written = m_is_samples_mapped ? slot.samples : slot.samples_stg;
+					for (auto &c : slot.dirty) {
+						auto r = samplesRange(slot, c);
+						m_allocator.flushAllocation(written.allocation, r.srcOffset, r.size);
+					}
+				}
+				slot.input_time = in.time;
+				{
+					std::lock_guard l(m_mtx);
+					m_ready.push_back(s);
+				}
+				m_cv.notify_all();
+			}
+		} catch (const fr::exception &e) {
+			std::printf("FATAL ERROR: %s\n", e.what());
+			quit();
+		}
+	}
+
+	// time from sampling the camera to presenting the frame showing it, printed every second
+	// along with the GPU time of the upload and draw when timestamps are available
+	struct Latency {
+		std::chrono::steady_clock::time_point bef = std::chrono::steady_clock::now();
+		uint32_t frames = 0;
+		double sum = 0.0;
+		double max = 0.0;
+		uint32_t gpu_frames = 0;
+		double gpu_sum = 0.0;
+		uint32_t redrawn = 0;
+		uint64_t columns = 0;
+		uint64_t uploaded = 0;
+
+		void add_gpu(double t)
+		{
+			gpu_frames++;
+			gpu_sum += t;
+		}
+
+		// to be called before the slot is handed back to the render thread
+		void add_upload(const Slot &slot)
+		{
+			redrawn += slot.is_redrawn;
+			columns += slot.w;
+			for (auto &c : slot.dirty)
+				uploaded += c.count;
+		}
+
+		void add(const Slot &slot, std::chrono::steady_clock::time_point present, uint32_t depth, const char *present_path)
+		{
+			auto l = std::chrono::duration<double>(present - slot.input_time).count();
+			frames++;
+			sum += l;
+			max = l > max ? l : max;
+			auto elapsed = std::chrono::duration<double>(present - bef).count();
+			if (elapsed < 1.0)
+				return;
+			std::printf("frames/s: %.1f, render size %ux%u, input to present: %.2f ms avg, %.2f ms max (queue depth %u)",
+				frames / elapsed, slot.w, slot.h, sum / frames * 1.0e3, max * 1.0e3, depth);
+			if (gpu_frames > 0)
+				std::printf(", gpu upload and draw: %.3f ms avg (%s present)", gpu_sum / gpu_frames * 1.0e3, present_path);
+			std::printf(", redrawn %.0f%%, uploaded %.0f%% of columns", 100.0 * redrawn / frames,
+				columns > 0 ? 100.0 * uploaded / columns : 0.0);
+			std::printf("\n");
+			*this = Latency{present};
+		}
+	};
 
 public:
 	Disp(bool isFullscreen)
 	{
+		m_start = std::chrono::steady_clock::now();
+		{
+			auto format = std::getenv("SBUILD_FORMAT");
+			m_is_indexed = format != nullptr && std::strcmp(format, "indexed") == 0;
+			std::printf("format: %s\n", m_is_indexed ? "indexed" : "rgba");
+			// in MiB, 0 keeps every texture resident, recorded and replayed frames must not depend on decode timings
+			size_t tex_budget = 0;
+			if (auto budget = std::getenv("SBUILD_TEX_BUDGET"))
+				tex_budget = static_cast<size_t>(std::atof(budget) * 1024.0 * 1024.0);
+			if (tex_budget > 0 && (std::getenv("SBUILD_REPLAY") != nullptr || std::getenv("SBUILD_RECORD") != nullptr)) {
+				std::printf("WARN: SBUILD_TEX_BUDGET is ignored while recording or replaying\n");
+				tex_budget = 0;
+			}
+			if (tex_budget > 0)
+				std::printf("texture budget: %.1f MiB\n", tex_budget / (1024.0 * 1024.0));
+			auto fmt = m_is_indexed ? Renderer::Format::indexed : Renderer::Format::rgba;
+			m_loading = std::async(std::launch::async, [this, fmt, tex_budget](){
+				auto bef = std::chrono::steady_clock::now();
+				const char *path = std::getenv("SBUILD_MAP");
+				if (path == nullptr)
+					path = "map/demo.sbm";
+				Map map;
+				Bsp bsp;
+				if (!mapfile::load(path, map, bsp))
+					fr::throw_runtime_error("can't load map");
+				if (map.texs.empty())
+					fr::throw_runtime_error("map names no texture");
+				// no framebuffer yet, the render thread sets that of its slot and the render size before every frame
+				auto res = std::make_unique<Renderer>(nullptr, 1, 1, map.texs, std::thread::hardware_concurrency(), fmt,
+					tex_budget);
+				res->set_map(std::move(map), std::move(bsp));
+				m_load_time = std::chrono::duration<double>(std::chrono::steady_clock::now() - bef).count();
+				return res;
+			});
+		}
+
 		glfwInit();
 		glfwWindowHint(GLFW_CLIENT_API, GLFW_NO_API);
 		glfwWindowHint(GLFW_RESIZABLE, GLFW_FALSE);
@@ -233,7 +724,14 @@ public:
 			size_t layer_count = 0;
 			const char *exts[16];
 			size_t ext_count = 0;
-			bool is_valid = true;
+			// SBUILD_VALIDATION=1 enables the Khronos validation layer and prints its messages, it is off otherwise as
+			// it slows the startup and every call down
+			auto validation = std::getenv("SBUILD_VALIDATION");
+			bool is_valid = validation != nullptr && std::strcmp(validation, "0") != 0;
+			if (is_valid && !hasInstanceLayer("VK_LAYER_KHRONOS_validation")) {
+				std::printf("WARN: VK_LAYER_KHRONOS_validation is not installed, running without validation\n");
+				is_valid = false;
+			}
 			{
 				uint32_t ec;
 				auto e = glfwGetRequiredInstanceExtensions(&ec);
@@ -249,18 +747,20 @@ public:
 			ci.enabledExtensionCount = ext_count;
 			ci.ppEnabledExtensionNames = exts;
 			m_instance = vkCreate(vkCreateInstance, ci);
-		}
-		{
-			VkDebugUtilsMessengerCreateInfoEXT ci{ .sType = VK_STRUCTURE_TYPE_DEBUG_UTILS_MESSENGER_CREATE_INFO_EXT };
-			ci.messageSeverity =
-				//VK_DEBUG_UTILS_MESSAGE_SEVERITY_VERBOSE_BIT_EXT |
-				VK_DEBUG_UTILS_MESSAGE_SEVERITY_INFO_BIT_EXT |
-				VK_DEBUG_UTILS_MESSAGE_SEVERITY_WARNING_BIT_EXT |
-				VK_DEBUG_UTILS_MESSAGE_SEVERITY_ERROR_BIT_EXT;
-			ci.messageType = VK_DEBUG_UTILS_MESSAGE_TYPE_GENERAL_BIT_EXT | VK_DEBUG_UTILS_MESSAGE_TYPE_VALIDATION_BIT_EXT |
-				VK_DEBUG_UTILS_MESSAGE_TYPE_PERFORMANCE_BIT_EXT;
-			ci.pfnUserCallback = &debugCallback;
-			vkAssert(getProcAddr(vkCreateDebugUtilsMessengerEXT)(m_instance, &ci, nullptr, &m_debug_callback));
+			m_debug_callback = VK_NULL_HANDLE;
+			if (is_valid) {
+				VkDebugUtilsMessengerCreateInfoEXT ci{ .sType = VK_STRUCTURE_TYPE_DEBUG_UTILS_MESSENGER_CREATE_INFO_EXT };
+				ci.messageSeverity =
+					//VK_DEBUG_UTILS_MESSAGE_SEVERITY_VERBOSE_BIT_EXT |
+					VK_DEBUG_UTILS_MESSAGE_SEVERITY_INFO_BIT_EXT |
+					VK_DEBUG_UTILS_MESSAGE_SEVERITY_WARNING_BIT_EXT |
+					VK_DEBUG_UTILS_MESSAGE_SEVERITY_ERROR_BIT_EXT;
+				ci.messageType = VK_DEBUG_UTILS_MESSAGE_TYPE_GENERAL_BIT_EXT | VK_DEBUG_UTILS_MESSAGE_TYPE_VALIDATION_BIT_EXT |
+					VK_DEBUG_UTILS_MESSAGE_TYPE_PERFORMANCE_BIT_EXT;
+				ci.pfnUserCallback = &debugCallback;
+				vkAssert(getProcAddr(vkCreateDebugUtilsMessengerEXT)(m_instance, &ci, nullptr, &m_debug_callback));
+			}
+			std::printf("validation: %s\n", is_valid ? "on" : "off");
 		}
 		vkAssert(glfwCreateWindowSurface(m_instance, m_window, nullptr, &m_surface));
 		{
@@ -293,6 +793,15 @@ public:
 				if (!has_pres)
 					fr::throw_runtime_error("can't find any presentation queue");
 			}
+			{
+				VkQueueFamilyProperties qprops[c];
+				vkGetPhysicalDeviceQueueFamilyProperties(m_physical_device, &c, qprops);
+				auto bits = qprops[m_queue_family].timestampValidBits;
+				m_timestamp_mask = bits >= 64 ? ~0ULL : (1ULL << bits) - 1;
+				VkPhysicalDeviceProperties props;
+				vkGetPhysicalDeviceProperties(m_physical_device, &props);
+				m_timestamp_period = props.limits.timestampPeriod;
+			}
 			{
 				vkAssert(getProcAddr(vkGetPhysicalDeviceSurfaceCapabilitiesKHR)(m_physical_device, m_surface, &m_surface_capabilities));
 			}
@@ -310,7 +819,19 @@ public:
 				std::printf("present mode: %d\n", m_present_mode);
 			}
 		}
-		fb_size = sizeof(uint32_t) + m_surface_capabilities.currentExtent.width * m_surface_capabilities.currentExtent.height * sizeof(uint32_t);
+		{
+			auto present = std::getenv("SBUILD_PRESENT");
+			m_is_present_image = present == nullptr || std::strcmp(present, "buffer") != 0;
+			std::printf("present: %s\n", m_is_present_image ? "image" : "buffer");
+		}
+		{
+			// 0 disables scaling
+			m_frame_budget = 15.0e-3;
+			if (auto budget = std::getenv("SBUILD_FRAME_BUDGET"))
+				m_frame_budget = std::atof(budget) * 1.0e-3;
+			std::printf("frame budget: %.1f ms\n", m_frame_budget * 1.0e3);
+		}
+		fb_size = sizeof(uint32_t) + m_surface_capabilities.currentExtent.width * m_surface_capabilities.currentExtent.height * pxSize();
 		{
 			VkDeviceCreateInfo ci{ .sType = VK_STRUCTURE_TYPE_DEVICE_CREATE_INFO };
 			VkDeviceQueueCreateInfo qci { .sType = VK_STRUCTURE_TYPE_DEVICE_QUEUE_CREATE_INFO };
@@ -326,7 +847,7 @@ public:
 			ci.enabledExtensionCount = array_size(exts);
 			ci.ppEnabledExtensionNames = exts;
 			VkPhysicalDeviceVulkan12Features features { .sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_VULKAN_1_2_FEATURES };
-			features.uniformAndStorageBuffer8BitAccess = VK_TRUE;
+			features.uniformAndStorageBuffer8BitAccess = m_is_present_image ? VK_FALSE : VK_TRUE;	// base.frag reads bytes
 			ci.pNext = &features;
 			vkAssert(vkCreateDevice(m_physical_device, &ci, nullptr, &m_device));
 		}
@@ -355,12 +876,31 @@ public:
 			vkAssert(getDeviceProcAddr(vkGetSwapchainImagesKHR)(m_device, m_swapchain, &c, is));
 			for (size_t i = 0; i < m_frame_count; i++) {
 				m_frames[i].img = is[i];
-				m_frames[i].samples_ready = createSemaphore();
-				m_frames[i].img_ready = createSemaphore();
 				m_frames[i].img_rendered = createSemaphore();
-				m_frames[i].img_rendered_fence = createFence();
 			}
 		}
+		{
+			// deeper queues keep the render thread busier at the cost of latency
+			m_slot_count = 2;
+			if (auto depth = std::getenv("SBUILD_QUEUE_DEPTH"))
+				m_slot_count = clamp(static_cast<uint32_t>(std::atoi(depth)), static_cast<uint32_t>(1), slot_max);
+			std::printf("queue depth: %u\n", m_slot_count);
+			for (size_t i = 0; i < m_slot_count; i++) {
+				m_slots[i].samples_ready = createSemaphore();
+				m_slots[i].img_ready = createSemaphore();
+				m_slots[i].fence = createFence(VK_FENCE_CREATE_SIGNALED_BIT);
+				m_slots[i].is_timed = false;
+				m_slots[i].is_drawn = false;
+				m_slots[i].is_img_valid = false;
+			}
+		}
+		if (m_timestamp_mask != 0) {
+			VkQueryPoolCreateInfo ci{ .sType = VK_STRUCTURE_TYPE_QUERY_POOL_CREATE_INFO };
+			ci.queryType = VK_QUERY_TYPE_TIMESTAMP;
+			ci.queryCount = m_slot_count * 2;
+			m_query_pool = vkCreate(vkCreateQueryPool, ci);
+		} else
+			m_query_pool = VK_NULL_HANDLE;
 		{
 			VkRenderPassCreateInfo ci{ .sType = VK_STRUCTURE_TYPE_RENDER_PASS_CREATE_INFO };
 
@@ -421,13 +961,19 @@ public:
 		}
 		{
 			m_fwd_v2_module = createShaderModule("sha/fwd_v2.vert.spv");
-			m_base_module = createShaderModule("sha/base.frag.spv");
+			m_base_module = createShaderModule(m_is_present_image ? "sha/img.frag.spv" : "sha/base.frag.spv");
 			{
 				VkDescriptorSetLayoutCreateInfo ci{ .sType = VK_STRUCTURE_TYPE_DESCRIPTOR_SET_LAYOUT_CREATE_INFO };
 				VkDescriptorSetLayoutBinding bindings[] = {
 					{
 						.binding = 0,
-						.descriptorType = VK_DESCRIPTOR_TYPE_STORAGE_BUFFER,
+						.descriptorType = samplesDescriptorType(),
+						.descriptorCount = 1,
+						.stageFlags = VK_SHADER_STAGE_FRAGMENT_BIT
+					},
+					{
+						.binding = 1,
+						.descriptorType = VK_DESCRIPTOR_TYPE_STORAGE_BUFFER,	// palette
 						.descriptorCount = 1,
 						.stageFlags = VK_SHADER_STAGE_FRAGMENT_BIT
 					}
@@ -437,13 +983,33 @@ public:
 				m_descriptor_set_layout = vkCreate(vkCreateDescriptorSetLayout, ci);
 			}
 			{
+				VkPushConstantRange range{
+					.stageFlags = VK_SHADER_STAGE_FRAGMENT_BIT,
+					.offset = 0,
+					.size = sizeof(uint32_t) * 4	// render size, then swapchain extent
+				};
 				VkPipelineLayoutCreateInfo ci{ .sType = VK_STRUCTURE_TYPE_PIPELINE_LAYOUT_CREATE_INFO,
 					.setLayoutCount = 1,
-					.pSetLayouts = &m_descriptor_set_layout
+					.pSetLayouts = &m_descriptor_set_layout,
+					.pushConstantRangeCount = 1,
+					.pPushConstantRanges = &range
 				};
 				m_pipeline_layout = vkCreate(vkCreatePipelineLayout, ci);
 			}
 			{
+				// the palette lookup is specialized away on rgba frames
+				VkSpecializationMapEntry spec_entry{
+					.constantID = 0,	// is_indexed
+					.offset = 0,
+					.size = sizeof(VkBool32)
+				};
+				VkBool32 spec_data = m_is_indexed ? VK_TRUE : VK_FALSE;
+				VkSpecializationInfo spec{
+					.mapEntryCount = 1,
+					.pMapEntries = &spec_entry,
+					.dataSize = sizeof(spec_data),
+					.pData = &spec_data
+				};
 				VkPipelineShaderStageCreateInfo stages[] = {
 					{
 						.sType = VK_STRUCTURE_TYPE_PIPELINE_SHADER_STAGE_CREATE_INFO,
@@ -455,7 +1021,8 @@ public:
 						.sType = VK_STRUCTURE_TYPE_PIPELINE_SHADER_STAGE_CREATE_INFO,
 						.stage = VK_SHADER_STAGE_FRAGMENT_BIT,
 						.module = m_base_module,
-						.pName = "main"
+						.pName = "main",
+						.pSpecializationInfo = &spec
 					}
 				};
 				VkVertexInputBindingDescription vertex_bindings[] = {
@@ -537,69 +1104,148 @@ public:
 					.renderPass = m_render_pass,
 					.subpass = 0
 				};
-				vkAssert(vkCreateGraphicsPipelines(m_device, VK_NULL_HANDLE, 1, &ci, nullptr, &m_pipeline));
+				m_pipeline_cache_path = std::getenv("SBUILD_PIPELINE_CACHE");
+				if (m_pipeline_cache_path == nullptr)
+					m_pipeline_cache_path = "res/pipeline.cache";
+				bool is_warm;
+				auto bef = std::chrono::steady_clock::now();
+				m_pipeline_cache = createPipelineCache(is_warm);
+				vkAssert(vkCreateGraphicsPipelines(m_device, m_pipeline_cache, 1, &ci, nullptr, &m_pipeline));
+				std::printf("pipeline: %.2f ms (%s cache)\n",
+					std::chrono::duration<double>(std::chrono::steady_clock::now() - bef).count() * 1.0e3, is_warm ? "warm" : "cold");
 			}
 		}
 		{
 			VkDescriptorPoolCreateInfo ci{ .sType = VK_STRUCTURE_TYPE_DESCRIPTOR_POOL_CREATE_INFO };
-			ci.maxSets = m_frame_count;
-			VkDescriptorPoolSize pool_size{
-				.type = VK_DESCRIPTOR_TYPE_STORAGE_BUFFER,
-				.descriptorCount = m_frame_count * 1
+			ci.maxSets = m_slot_count;
+			VkDescriptorPoolSize pool_sizes[] = {
+				{
+					.type = samplesDescriptorType(),
+					.descriptorCount = m_slot_count * 1
+				},
+				{
+					.type = VK_DESCRIPTOR_TYPE_STORAGE_BUFFER,
+					.descriptorCount = m_slot_count * 1
+				}
 			};
-			ci.poolSizeCount = 1;
-			ci.pPoolSizes = &pool_size;
+			ci.poolSizeCount = array_size(pool_sizes);
+			ci.pPoolSizes = pool_sizes;
 			m_descriptor_pool = vkCreate(vkCreateDescriptorPool, ci);
 		}
 		{
 			VkDescriptorSetAllocateInfo ai{ .sType = VK_STRUCTURE_TYPE_DESCRIPTOR_SET_ALLOCATE_INFO };
 			ai.descriptorPool = m_descriptor_pool;
-			ai.descriptorSetCount = m_frame_count;
-			VkDescriptorSetLayout layouts[m_frame_count];
-			for (size_t i = 0; i < m_frame_count; i++)
+			ai.descriptorSetCount = m_slot_count;
+			VkDescriptorSetLayout layouts[m_slot_count];
+			for (size_t i = 0; i < m_slot_count; i++)
 				layouts[i] = m_descriptor_set_layout;
 			ai.pSetLayouts =  layouts;
-			VkDescriptorSet sets[m_frame_count];
+			VkDescriptorSet sets[m_slot_count];
 			vkAssert(vkAllocateDescriptorSets(m_device, &ai, sets));
-			for (size_t i = 0; i < m_frame_count; i++)
-				m_frames[i].desc_set = sets[i];
+			for (size_t i = 0; i < m_slot_count; i++)
+				m_slots[i].desc_set = sets[i];
 		}
+		// the image present copies from any host memory, the buffer present reads device local memory when it can
+		m_is_samples_mapped = m_is_present_image ||
+			hasMemoryType(VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT | VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT);
+		std::printf("samples upload: %s\n", m_is_present_image ? "image copy" :
+			(m_is_samples_mapped ? "mapped device local" : "staging copy"));
+		if (m_is_present_image) {
+			VkSamplerCreateInfo ci{ .sType = VK_STRUCTURE_TYPE_SAMPLER_CREATE_INFO };
+			ci.magFilter = VK_FILTER_NEAREST;
+			ci.minFilter = VK_FILTER_NEAREST;
+			ci.mipmapMode = VK_SAMPLER_MIPMAP_MODE_NEAREST;
+			ci.addressModeU = VK_SAMPLER_ADDRESS_MODE_CLAMP_TO_EDGE;
+			ci.addressModeV = VK_SAMPLER_ADDRESS_MODE_CLAMP_TO_EDGE;
+			ci.addressModeW = VK_SAMPLER_ADDRESS_MODE_CLAMP_TO_EDGE;
+			m_sampler = vkCreate(vkCreateSampler, ci);
+		} else
+			m_sampler = VK_NULL_HANDLE;
 		{
-			VkWriteDescriptorSet ws[m_frame_count];
-			VkDescriptorBufferInfo bis[m_frame_count];
-			for (size_t i = 0; i < m_frame_count; i++) {
+			// filled once the renderer has its textures, rgba frames never read it
+			VkBufferCreateInfo ci{ .sType = VK_STRUCTURE_TYPE_BUFFER_CREATE_INFO };
+			ci.size = 256 * sizeof(uint32_t);
+			ci.usage = VK_BUFFER_USAGE_TRANSFER_DST_BIT | VK_BUFFER_USAGE_STORAGE_BUFFER_BIT;
+			fr::AllocCreateInfo ai{};
+			ai.usage = VMA_MEMORY_USAGE_GPU_ONLY;
+			m_palette = m_allocator.createBuffer(ci, ai);
+		}
+		{
+			VkWriteDescriptorSet ws[m_slot_count * 2];
+			VkDescriptorBufferInfo bis[m_slot_count];
+			VkDescriptorImageInfo iis[m_slot_count];
+			VkDescriptorBufferInfo pal_bi{
+				.buffer = m_palette.buffer,
+				.offset = 0,
+				.range = 256 * sizeof(uint32_t)
+			};
+			for (size_t i = 0; i < m_slot_count; i++) {
+				auto &f = m_slots[i];
 				VkBufferCreateInfo ci{ .sType = VK_STRUCTURE_TYPE_BUFFER_CREATE_INFO };
 				ci.size = fb_size;
 				ci.usage = VK_BUFFER_USAGE_TRANSFER_DST_BIT | VK_BUFFER_USAGE_STORAGE_BUFFER_BIT;
 				fr::AllocCreateInfo ai{};
-				ai.usage = VMA_MEMORY_USAGE_GPU_ONLY;
-				auto buf = m_allocator.createBuffer(ci, ai);
-				m_frames[i].samples = buf;
-				{
+				f.samples_stg = fr::BufferAllocation{ VK_NULL_HANDLE, VK_NULL_HANDLE };
+				f.samples_img = fr::ImageAllocation{ VK_NULL_HANDLE, VK_NULL_HANDLE };
+				f.samples_view = VK_NULL_HANDLE;
+				if (m_is_present_image) {
+					ci.usage = VK_BUFFER_USAGE_TRANSFER_SRC_BIT;
+					ai.usage = VMA_MEMORY_USAGE_CPU_TO_GPU;
+					ai.flags = VMA_ALLOCATION_CREATE_MAPPED_BIT;
+					f.samples = m_allocator.createBuffer(ci, ai, &f.samples_ptr);
+					f.samples_img = createSamplesImage();
+					f.samples_view = createSamplesView(f.samples_img.image);
+				} else if (m_is_samples_mapped) {
+					ai.usage = VMA_MEMORY_USAGE_CPU_TO_GPU;
+					ai.flags = VMA_ALLOCATION_CREATE_MAPPED_BIT;
+					ai.required_flags = VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT | VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT;
+					f.samples = m_allocator.createBuffer(ci, ai, &f.samples_ptr);
+				} else {
+					ai.usage = VMA_MEMORY_USAGE_GPU_ONLY;
+					f.samples = m_allocator.createBuffer(ci, ai);
 					VkBufferCreateInfo ci{ .sType = VK_STRUCTURE_TYPE_BUFFER_CREATE_INFO };
 					ci.size = fb_size;
 					ci.usage = VK_BUFFER_USAGE_TRANSFER_SRC_BIT;
 					fr::AllocCreateInfo ai{};
 					ai.usage = VMA_MEMORY_USAGE_CPU_TO_GPU;
 					ai.flags = VMA_ALLOCATION_CREATE_MAPPED_BIT;
-					m_frames[i].samples_stg = m_allocator.createBuffer(ci, ai, &m_frames[i].samples_stg_ptr);
+					f.samples_stg = m_allocator.createBuffer(ci, ai, &f.samples_ptr);
 				}
+				auto &buf = f.samples;
 				auto &w = ws[i];
 				w = VkWriteDescriptorSet{ .sType = VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET };
-				w.dstSet = m_frames[i].desc_set;
+				w.dstSet = f.desc_set;
 				w.dstBinding = 0;
 				w.dstArrayElement = 0;
 				w.descriptorCount = 1;
-				w.descriptorType = VK_DESCRIPTOR_TYPE_STORAGE_BUFFER;
-				auto &bi = bis[i];
-				bi = VkDescriptorBufferInfo {
-					.buffer = buf.buffer,
-					.offset = 0,
-					.range = ci.size
-				};
-				w.pBufferInfo = &bi;
+				w.descriptorType = samplesDescriptorType();
+				if (m_is_present_image) {
+					auto &ii = iis[i];
+					ii = VkDescriptorImageInfo {
+						.sampler = m_sampler,
+						.imageView = f.samples_view,
+						.imageLayout = VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL
+					};
+					w.pImageInfo = &ii;
+				} else {
+					auto &bi = bis[i];
+					bi = VkDescriptorBufferInfo {
+						.buffer = buf.buffer,
+						.offset = 0,
+						.range = ci.size
+					};
+					w.pBufferInfo = &bi;
+				}
+				auto &pw = ws[m_slot_count + i];
+				pw = VkWriteDescriptorSet{ .sType = VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET };
+				pw.dstSet = f.desc_set;
+				pw.dstBinding = 1;
+				pw.dstArrayElement = 0;
+				pw.descriptorCount = 1;
+				pw.descriptorType = VK_DESCRIPTOR_TYPE_STORAGE_BUFFER;
+				pw.pBufferInfo = &pal_bi;
 			}
-			vkUpdateDescriptorSets(m_device, m_frame_count, ws, 0, nullptr);
+			vkUpdateDescriptorSets(m_device, m_slot_count * 2, ws, 0, nullptr);
 		}
 		{
 			VkCommandPoolCreateInfo ci{ .sType = VK_STRUCTURE_TYPE_COMMAND_POOL_CREATE_INFO };
@@ -611,12 +1257,12 @@ public:
 			VkCommandBufferAllocateInfo ai{ .sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_ALLOCATE_INFO };
 			ai.commandPool = m_command_pool;
 			ai.level = VK_COMMAND_BUFFER_LEVEL_PRIMARY;
-			ai.commandBufferCount = m_frame_count * 2;
-			VkCommandBuffer cmds[m_frame_count * 2];
+			ai.commandBufferCount = m_slot_count * 2;
+			VkCommandBuffer cmds[m_slot_count * 2];
 			vkAssert(vkAllocateCommandBuffers(m_device, &ai, cmds));
-			for (size_t i = 0; i < m_frame_count; i++) {
-				m_frames[i].cmd_trans = cmds[i * 2];
-				m_frames[i].cmd = cmds[i * 2 + 1];
+			for (size_t i = 0; i < m_slot_count; i++) {
+				m_slots[i].cmd_trans = cmds[i * 2];
+				m_slots[i].cmd = cmds[i * 2 + 1];
 			}
 		}
 		{
@@ -633,26 +1279,42 @@ public:
 			m_fullscreen_vertex = m_allocator.createBuffer(ci, ai);
 			transferSync(m_fullscreen_vertex.buffer, sizeof(data), data);
 		}
+		m_init_time = std::chrono::duration<double>(std::chrono::steady_clock::now() - m_start).count();
 	}
 	~Disp(void)
 	{
+		for (size_t i = 0; i < m_slot_count; i++) {
+			auto &s = m_slots[i];
+			if (!m_is_samples_mapped)
+				m_allocator.destroy(s.samples_stg);
+			if (m_is_present_image) {
+				vkDestroy(vkDestroyImageView, s.samples_view);
+				m_allocator.destroy(s.samples_img);
+			}
+			m_allocator.destroy(s.samples);
+			destroy(s.fence);
+			destroy(s.img_ready);
+			destroy(s.samples_ready);
+		}
 		for (size_t i = 0; i < m_frame_count; i++) {
 			auto &f = m_frames[i];
-			m_allocator.destroy(f.samples_stg);
-			m_allocator.destroy(f.samples);
-			destroy(f.img_rendered_fence);
 			destroy(f.img_rendered);
-			destroy(f.img_ready);
-			destroy(f.samples_ready);
 			vkDestroy(vkDestroyFramebuffer, f.framebuffer);
 			vkDestroy(vkDestroyImageView, f.img_view);
 		}
 
+		if (m_query_pool != VK_NULL_HANDLE)
+			vkDestroy(vkDestroyQueryPool, m_query_pool);
+		if (m_sampler != VK_NULL_HANDLE)
+			vkDestroy(vkDestroySampler, m_sampler);
 		m_allocator.destroy(m_fullscreen_vertex);
+		m_allocator.destroy(m_palette);
 		vkDestroy(vkDestroyCommandPool, m_command_pool);
 		vkDestroy(vkDestroyDescriptorPool, m_descriptor_pool);
 
 		vkDestroy(vkDestroyPipeline, m_pipeline);
+		savePipelineCache();
+		vkDestroy(vkDestroyPipelineCache, m_pipeline_cache);
 		vkDestroy(vkDestroyPipelineLayout, m_pipeline_layout);
 		vkDestroy(vkDestroyDescriptorSetLayout, m_descriptor_set_layout);
 		vkDestroy(vkDestroyShaderModule, m_base_module);
@@ -664,13 +1326,26 @@ public:
 		m_allocator.destroy();
 
 		vkDestroyDevice(m_device, nullptr);
-		vkDestroy(getProcAddr(vkDestroyDebugUtilsMessengerEXT), m_debug_callback);
+		if (m_debug_callback != VK_NULL_HANDLE)
+			vkDestroy(getProcAddr(vkDestroyDebugUtilsMessengerEXT), m_debug_callback);
 		vkDestroy(vkDestroySurfaceKHR, m_surface);
 		vkDestroyInstance(m_instance, nullptr);
 		glfwDestroyWindow(m_window);
 		glfwTerminate();
 	}
 
+	// stage timings of the last frames, also written as a Chrome trace to SBUILD_TRACE when set
+	static void dumpProf(void)
+	{
+		prof::print_summary();
+		if (auto path = std::getenv("SBUILD_TRACE")) {
+			if (prof::write_trace(path))
+				std::printf("trace written to %s\n", path);
+			else
+				std::printf("can't write trace to %s\n", path);
+		}
+	}
+
 	static void paAssert(PaError err)
 	{
 		if (err != paNoError) {
@@ -684,31 +1359,76 @@ public:
 	{
 		uint32_t w = m_surface_capabilities.currentExtent.width;
 		uint32_t h = m_surface_capabilities.currentExtent.height;
-		uint8_t *fb = new uint8_t[sizeof(uint32_t) * w * h];
-		*reinterpret_cast<uint32_t*>(fb) = h;
-		auto fb_data = fb + sizeof(uint32_t);
-		Renderer renderer(reinterpret_cast<uint32_t*>(fb_data), w, h);
+		auto bef_wait = std::chrono::steady_clock::now();
+		auto loaded = m_loading.get();
+		auto load_wait = std::chrono::duration<double>(std::chrono::steady_clock::now() - bef_wait).count();
+		auto &renderer = *loaded;
+		renderer.set_fb(fbData(m_slots[0]));
+		renderer.set_size(w, h);
+		transferSync(m_palette.buffer, 256 * sizeof(uint32_t), renderer.palette());
+
+		m_input = Input{ivec2(0, 0), 0, std::chrono::steady_clock::now()};
+		m_ready.clear();
+		m_free = m_slot_count;
+		m_quit = false;
+		m_is_replaying = false;
+		m_replay_frame = 0;
+		m_replay_mismatches = 0;
+		if (auto path = std::getenv("SBUILD_REPLAY")) {
+			m_is_replaying = m_replay.open(path) && m_replay.size() > 0;
+			if (m_is_replaying)
+				std::printf("replaying %zu frames from %s\n", m_replay.size(), path);
+			else
+				std::printf("can't replay %s\n", path);
+		} else if (auto path = std::getenv("SBUILD_RECORD")) {
+			if (m_record.open(path))
+				std::printf("recording to %s\n", path);
+			else
+				std::printf("can't record to %s\n", path);
+		}
+		std::thread render_thread([&](){
+			renderLoop(renderer);
+		});
+		// stops the render thread however the loop ends, exceptions included
+		struct Stop {
+			Disp &d;
+			std::thread &t;
+
+			~Stop(void)
+			{
+				{
+					std::lock_guard l(d.m_mtx);
+					d.m_quit = true;
+				}
+				d.m_cv.notify_all();
+				t.join();
+				vkDeviceWaitIdle(d.m_device);
+				d.m_record.close();
+				if (d.m_is_replaying)
+					std::printf("replay: %zu of %zu frames, %zu hash mismatches\n", d.m_replay_frame, d.m_replay.size(),
+						d.m_replay_mismatches);
+				dumpProf();
+			}
+		} stop{*this, render_thread};
 
 		auto acquireNextImage = getDeviceProcAddr(vkAcquireNextImageKHR);
-		size_t frame_ndx = 0;
 		ivec2 camp(0, 0);
 		int32_t camele = 0;
 		auto bef = std::chrono::high_resolution_clock::now();
+		Latency lat;
+		bool is_first_presented = false;
+		bool was_dump_pressed = false;
 		while (true) {
 			glfwPollEvents();
 			if (glfwGetKey(m_window, GLFW_KEY_ESCAPE) == GLFW_PRESS)
 				break;
 			if (glfwWindowShouldClose(m_window))
 				break;
-
-			uint32_t img_ndx;
-			auto &img_ready = m_frames[frame_ndx].img_ready;
-			vkAssert(acquireNextImage(m_device, m_swapchain, ~0ULL, img_ready, VK_NULL_HANDLE, &img_ndx));
-
-			auto &frame = m_frames[img_ndx];
-			if (frame.ever_submitted) {
-				vkAssert(vkWaitForFences(m_device, 1, &frame.img_rendered_fence, VK_TRUE, ~0ULL));
-				vkResetFences(m_device, 1, &frame.img_rendered_fence);
+			{
+				bool is_dump_pressed = glfwGetKey(m_window, GLFW_KEY_P) == GLFW_PRESS;
+				if (is_dump_pressed && !was_dump_pressed)
+					dumpProf();
+				was_dump_pressed = is_dump_pressed;
 			}
 
 			auto now = std::chrono::high_resolution_clock::now();
@@ -728,58 +1448,109 @@ public:
 			if (glfwGetKey(m_window, GLFW_KEY_LEFT_SHIFT) == GLFW_PRESS)
 				camele += cam_delta;
 
+			// the render thread picks the latest camera whenever it starts a frame, we present the oldest rendered one
+			uint32_t slot_ndx;
 			{
-				renderer.render(camp, camele);
-				std::memcpy(frame.samples_stg_ptr, fb, fb_size);
-				m_allocator.flushAllocation(frame.samples_stg.allocation, 0, fb_size);	// flush device cache to make visible samples
+				std::unique_lock l(m_mtx);
+				m_input = Input{camp, camele, std::chrono::steady_clock::now()};
+				m_cv.wait(l, [&](){
+					return m_quit || !m_ready.empty();
+				});
+				if (m_quit)
+					break;
+				slot_ndx = m_ready.front();
+				m_ready.pop_front();
 			}
+			auto &slot = m_slots[slot_ndx];
+
+			// the slot fence was waited for by the render thread, the slot semaphores are free again
+			uint32_t img_ndx;
 			{
-				{
-					VkCommandBufferBeginInfo bi{ .sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_BEGIN_INFO };
-					bi.flags = VK_COMMAND_BUFFER_USAGE_ONE_TIME_SUBMIT_BIT;
-					vkAssert(vkBeginCommandBuffer(frame.cmd_trans, &bi));
-					VkBufferCopy region {
-						.srcOffset = 0,
-						.dstOffset = 0,
-						.size = fb_size
-					};
-					vkCmdCopyBuffer(frame.cmd_trans, frame.samples_stg.buffer, frame.samples.buffer, 1, &region);
-					vkAssert(vkEndCommandBuffer(frame.cmd_trans));
+				prof::Scope scope(prof::Stage::acquire);
+				vkAssert(acquireNextImage(m_device, m_swapchain, ~0ULL, slot.img_ready, VK_NULL_HANDLE, &img_ndx));
+			}
+			auto &frame = m_frames[img_ndx];
+			auto record_begin = prof::now();
+
+			// the last submit of the slot is done, its timestamps are there
+			uint32_t query = slot_ndx * 2;
+			if (slot.is_timed) {
+				uint64_t ts[2];
+				if (vkGetQueryPoolResults(m_device, m_query_pool, query, 2, sizeof(ts), ts, sizeof(uint64_t),
+					VK_QUERY_RESULT_64_BIT) == VK_SUCCESS)
+					lat.add_gpu(((ts[1] - ts[0]) & m_timestamp_mask) * m_timestamp_period * 1.0e-9);
+			}
+			slot.is_timed = m_query_pool != VK_NULL_HANDLE;
+			// the first command buffer of the slot resets its queries and stamps the start of the upload
+			auto begin_timed = [&](VkCommandBuffer cmd){
+				VkCommandBufferBeginInfo bi{ .sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_BEGIN_INFO };
+				bi.flags = VK_COMMAND_BUFFER_USAGE_ONE_TIME_SUBMIT_BIT;
+				vkAssert(vkBeginCommandBuffer(cmd, &bi));
+				if (slot.is_timed) {
+					vkCmdResetQueryPool(cmd, m_query_pool, query, 2);
+					vkCmdWriteTimestamp(cmd, VK_PIPELINE_STAGE_TOP_OF_PIPE_BIT, m_query_pool, query);
 				}
+			};
+
+			// an unchanged frame is presented again from what the device already holds, without any upload
+			bool is_copying = !m_is_samples_mapped && !slot.dirty.empty();
+			if (is_copying) {
+				begin_timed(slot.cmd_trans);
+				m_buffer_copies.clear();
+				for (auto &c : slot.dirty)
+					m_buffer_copies.emplace_back(samplesRange(slot, c));
+				vkCmdCopyBuffer(slot.cmd_trans, slot.samples_stg.buffer, slot.samples.buffer, m_buffer_copies.size(),
+					m_buffer_copies.data());
+				vkAssert(vkEndCommandBuffer(slot.cmd_trans));
 			}
 
-			{
+			if (!is_copying)
+				begin_timed(slot.cmd);
+			else {
 				VkCommandBufferBeginInfo bi{ .sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_BEGIN_INFO };
 				bi.flags = VK_COMMAND_BUFFER_USAGE_ONE_TIME_SUBMIT_BIT;
-				vkAssert(vkBeginCommandBuffer(frame.cmd, &bi));
+				vkAssert(vkBeginCommandBuffer(slot.cmd, &bi));
 			}
+			if (m_is_present_image && !slot.dirty.empty())
+				copySamplesToImage(slot);
 			{
 				VkRenderPassBeginInfo rbi{ .sType = VK_STRUCTURE_TYPE_RENDER_PASS_BEGIN_INFO };
 				rbi.renderPass = m_render_pass;
 				rbi.framebuffer = frame.framebuffer;
 				rbi.renderArea.offset = VkOffset2D{};
 				rbi.renderArea.extent = m_surface_capabilities.currentExtent;
-				vkCmdBeginRenderPass(frame.cmd, &rbi, VK_SUBPASS_CONTENTS_INLINE);
+				vkCmdBeginRenderPass(slot.cmd, &rbi, VK_SUBPASS_CONTENTS_INLINE);
 				{
-					vkCmdBindDescriptorSets(frame.cmd, VK_PIPELINE_BIND_POINT_GRAPHICS, m_pipeline_layout, 0, 1, &frame.desc_set, 0, nullptr);
-					vkCmdBindPipeline(frame.cmd, VK_PIPELINE_BIND_POINT_GRAPHICS, m_pipeline);
+					vkCmdBindDescriptorSets(slot.cmd, VK_PIPELINE_BIND_POINT_GRAPHICS, m_pipeline_layout, 0, 1, &slot.desc_set, 0, nullptr);
+					vkCmdBindPipeline(slot.cmd, VK_PIPELINE_BIND_POINT_GRAPHICS, m_pipeline);
+					{
+						uint32_t pc[] = {
+							slot.w, slot.h,
+							m_surface_capabilities.currentExtent.width, m_surface_capabilities.currentExtent.height
+						};
+						vkCmdPushConstants(slot.cmd, m_pipeline_layout, VK_SHADER_STAGE_FRAGMENT_BIT, 0, sizeof(pc), pc);
+					}
 					{
 						VkDeviceSize o = 0;
-						vkCmdBindVertexBuffers(frame.cmd, 0, 1, &m_fullscreen_vertex.buffer, &o);
+						vkCmdBindVertexBuffers(slot.cmd, 0, 1, &m_fullscreen_vertex.buffer, &o);
 					}
-					vkCmdDraw(frame.cmd, 3, 1, 0, 0);
+					vkCmdDraw(slot.cmd, 3, 1, 0, 0);
 				}
-				vkCmdEndRenderPass(frame.cmd);
+				vkCmdEndRenderPass(slot.cmd);
 			}
-			vkAssert(vkEndCommandBuffer(frame.cmd));
+			if (slot.is_timed)
+				vkCmdWriteTimestamp(slot.cmd, VK_PIPELINE_STAGE_BOTTOM_OF_PIPE_BIT, m_query_pool, query + 1);
+			vkAssert(vkEndCommandBuffer(slot.cmd));
+			prof::record(prof::Stage::record, record_begin, prof::now());
 			{
+				prof::Scope scope(prof::Stage::submit);
 				VkSemaphore wait_render[] = {
-					frame.samples_ready,
-					img_ready
+					slot.img_ready,
+					slot.samples_ready
 				};
 				VkPipelineStageFlags wait_render_stages[] = {
-					VK_PIPELINE_STAGE_FRAGMENT_SHADER_BIT,
 					VK_PIPELINE_STAGE_COLOR_ATTACHMENT_OUTPUT_BIT,
+					VK_PIPELINE_STAGE_FRAGMENT_SHADER_BIT
 				};
 				VkSubmitInfo sis[] = {
 					{.sType = VK_STRUCTURE_TYPE_SUBMIT_INFO,
@@ -787,24 +1558,32 @@ public:
 						.pWaitSemaphores = nullptr,
 						.pWaitDstStageMask = nullptr,
 						.commandBufferCount = 1,
-						.pCommandBuffers = &frame.cmd_trans,
+						.pCommandBuffers = &slot.cmd_trans,
 						.signalSemaphoreCount = 1,
-						.pSignalSemaphores = &frame.samples_ready,
+						.pSignalSemaphores = &slot.samples_ready,
 					},
 					{.sType = VK_STRUCTURE_TYPE_SUBMIT_INFO,
-						.waitSemaphoreCount = array_size(wait_render),
+						.waitSemaphoreCount = static_cast<uint32_t>(is_copying ? array_size(wait_render) : 1),	// mapped samples are visible at submit
 						.pWaitSemaphores = wait_render,
 						.pWaitDstStageMask = wait_render_stages,
 						.commandBufferCount = 1,
-						.pCommandBuffers = &frame.cmd,
+						.pCommandBuffers = &slot.cmd,
 						.signalSemaphoreCount = 1,
 						.pSignalSemaphores = &frame.img_rendered
 					}
 				};
-				vkAssert(vkQueueSubmit(m_queue, array_size(sis), sis, frame.img_rendered_fence));
+				// mapped samples and unchanged frames skip the copy submit
+				vkAssert(vkResetFences(m_device, 1, &slot.fence));
+				vkAssert(vkQueueSubmit(m_queue, is_copying ? array_size(sis) : 1, is_copying ? sis : sis + 1, slot.fence));
+			}
+			lat.add_upload(slot);
+			{
+				std::lock_guard l(m_mtx);
+				m_free++;
 			}
-			frame.ever_submitted = true;
+			m_cv.notify_all();
 			{
+				prof::Scope scope(prof::Stage::present);
 				VkPresentInfoKHR pi{ .sType = VK_STRUCTURE_TYPE_PRESENT_INFO_KHR };
 				pi.waitSemaphoreCount = 1;
 				pi.pWaitSemaphores = &frame.img_rendered;
@@ -813,10 +1592,15 @@ public:
 				pi.pImageIndices = &img_ndx;
 				vkAssert(vkQueuePresentKHR(m_queue, &pi));
 			}
-
-			frame_ndx = (frame_ndx + 1) % m_frame_count;
+			lat.add(slot, std::chrono::steady_clock::now(), m_slot_count, m_is_present_image ? "image" : "buffer");
+			if (!is_first_presented) {
+				is_first_presented = true;
+				// from the Disp construction to the first present returning, the loading time beyond the Vulkan
+				// startup shows up as waited for
+				std::printf("time to first frame: %.1f ms (vulkan init %.1f ms, textures and map %.1f ms, %.1f ms waited for)\n",
+					std::chrono::duration<double>(std::chrono::steady_clock::now() - m_start).count() * 1.0e3,
+					m_init_time * 1.0e3, m_load_time * 1.0e3, load_wait * 1.0e3);
+			}
 		}
-		delete[] fb;
-		vkAssert(vkDeviceWaitIdle(m_device));
 	}
 };
\ No newline at end of file
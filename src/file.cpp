@@ -0,0 +1,90 @@
+#include "file.hpp"
+
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+
+MappedFile::~MappedFile(void)
+{
+	close();
+}
+
+#ifdef _WIN32
+
+bool MappedFile::open(const char *path)
+{
+	close();
+	auto file = CreateFileA(path, GENERIC_READ, FILE_SHARE_READ, nullptr, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, nullptr);
+	if (file == INVALID_HANDLE_VALUE)
+		return false;
+	LARGE_INTEGER size;
+	if (!GetFileSizeEx(file, &size) || size.QuadPart == 0) {
+		CloseHandle(file);
+		return false;
+	}
+	auto mapping = CreateFileMappingA(file, nullptr, PAGE_READONLY, 0, 0, nullptr);
+	if (mapping == nullptr) {
+		CloseHandle(file);
+		return false;
+	}
+	auto data = MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0);
+	if (data == nullptr) {
+		CloseHandle(mapping);
+		CloseHandle(file);
+		return false;
+	}
+	m_file = file;
+	m_mapping = mapping;
+	m_data = data;
+	m_size = size.QuadPart;
+	return true;
+}
+
+void MappedFile::close(void)
+{
+	if (m_data == nullptr)
+		return;
+	UnmapViewOfFile(m_data);
+	CloseHandle(m_mapping);
+	CloseHandle(m_file);
+	m_data = nullptr;
+	m_size = 0;
+}
+
+#else
+
+bool MappedFile::open(const char *path)
+{
+	close();
+	int fd = ::open(path, O_RDONLY);
+	if (fd < 0)
+		return false;
+	struct stat st;
+	if (fstat(fd, &st) != 0 || st.st_size == 0) {
+		::close(fd);
+		return false;
+	}
+	auto data = mmap(nullptr, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	::close(fd);	// the mapping keeps the file alive
+	if (data == MAP_FAILED)
+		return false;
+	m_data = data;
+	m_size = st.st_size;
+	return true;
+}
+
+void MappedFile::close(void)
+{
+	if (m_data == nullptr)
+		return;
+	munmap(const_cast<void*>(m_data), m_size);
+	m_data = nullptr;
+	m_size = 0;
+}
+
+#endif
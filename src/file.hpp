@@ -0,0 +1,34 @@
+#pragma once
+
+#include <cstddef>
+
+// read-only memory mapping of a whole file
+class MappedFile
+{
+	const void *m_data = nullptr;
+	size_t m_size = 0;
+#ifdef _WIN32
+	void *m_file = nullptr;
+	void *m_mapping = nullptr;
+#endif
+
+public:
+	MappedFile(void) = default;
+	MappedFile(const MappedFile&) = delete;
+	MappedFile& operator=(const MappedFile&) = delete;
+	~MappedFile(void);
+
+	// returns false and stays unmapped if the file is missing, empty or can't be mapped
+	bool open(const char *path);
+	void close(void);
+
+	const void* data(void) const
+	{
+		return m_data;
+	}
+
+	size_t size(void) const
+	{
+		return m_size;
+	}
+};
@@ -0,0 +1,188 @@
+#pragma once
+
+#include "tex.hpp"
+#include <cstdint>
+#include <vector>
+#include <cmath>
+
+static inline constexpr int32_t tex_scale(int32_t s)
+{
+	return s * tex::ref_size / 1000;
+}
+
+struct ivec2 {
+	int32_t x;
+	int32_t y;
+
+	using own = ivec2;
+
+	inline ivec2(int32_t x, int32_t y) :
+		x(x),
+		y(y)
+	{
+	}
+
+	inline auto operator-(const own &other) const
+	{
+		return own(x - other.x, y - other.y);
+	}
+
+	inline auto operator+(const own &other) const
+	{
+		return own(x + other.x, y + other.y);
+	}
+
+	inline auto operator*(int32_t s) const
+	{
+		return own(x * s, y * s);
+	}
+
+	inline void operator-=(const own &other)
+	{
+		*this = *this - other;
+	}
+
+	inline void operator+=(const own &other)
+	{
+		*this = *this + other;
+	}
+
+	inline bool operator==(const own &other) const = default;
+
+	int32_t dot(const own &other) const
+	{
+		return x * other.x + y * other.y;
+	}
+
+	int32_t norm_tex(void) const
+	{
+		return std::sqrt(tex_scale(dot(*this)));
+	}
+};
+
+inline int32_t min(int32_t a, int32_t b)
+{
+	return a < b ? a : b;
+}
+
+inline int32_t max(int32_t a, int32_t b)
+{
+	return a > b ? a : b;
+}
+
+// left shift by s, right shift when s is negative
+inline int32_t shift(int32_t v, int32_t s)
+{
+	return s >= 0 ? v << s : v >> -s;
+}
+
+struct Wall {
+	ivec2 a;
+	ivec2 b;
+	int32_t ele_low;
+	int32_t ele_up;
+	int32_t u;	// texel column at a, not 0 for the pieces of a split wall
+	int32_t w;
+	int32_t h;
+	uint32_t tex;
+	int32_t portal;	// sector seen through this wall, -1 for a solid wall
+	int32_t light;	// added to the light of its sector, walls facing different ways can be told apart
+
+
+	Wall(ivec2 a, ivec2 b, int32_t ele_low, int32_t ele_up, uint32_t tex = 0, int32_t portal = -1) :
+		a(a),
+		b(b),
+		ele_low(ele_low),
+		ele_up(ele_up),
+		u(0),
+		w((b - a).norm_tex()),
+		h(tex_scale((ele_up - ele_low))),
+		tex(tex),
+		portal(portal),
+		light(0)
+	{
+	}
+
+	// > 0 when p is in front of the wall, the side it is drawn from
+	int64_t side(const ivec2 &p) const
+	{
+		return side(a, b, p);
+	}
+
+	// same for the line through a and b
+	static int64_t side(const ivec2 &a, const ivec2 &b, const ivec2 &p)
+	{
+		auto d = b - a;
+		auto e = p - a;
+		return static_cast<int64_t>(d.y) * e.x - static_cast<int64_t>(d.x) * e.y;
+	}
+};
+
+// convex polygon, its walls are walls[first, first + count) in clockwise order (seen from above) so that they all
+// face the inside
+// ele_low and ele_up are its ceiling and floor, seen through a portal they bound the opening
+// light goes from 0, black, to 255, full bright up close
+struct Sector {
+	uint32_t first;
+	uint32_t count;
+	int32_t ele_low;
+	int32_t ele_up;
+	int32_t light = 255;
+};
+
+// billboard always facing the camera, its texture spans it once
+struct Sprite {
+	ivec2 p;	// its middle, seen from above
+	int32_t ele_low;
+	int32_t ele_up;
+	int32_t width;
+	uint32_t tex;
+	int32_t light = 0;	// added to the light of its sector
+};
+
+// texture source, walls, masked walls and sprites name it by its index in Map::texs
+// a fixed size record so that binary maps hold it as it is in memory
+struct Texture {
+	char path[252];	// null terminated
+	uint32_t is_alpha;	// 1 for a masked texture, see tex::Source
+};
+
+struct Map {
+	std::vector<Texture> texs;	// the textures its walls were made for, given to the Renderer drawing it
+	std::vector<Wall> walls;
+	std::vector<Sector> sectors;	// empty for a plain wall soup, drawn without any visibility
+	// drawn over the walls where their texture is not transparent, they neither hide walls nor portals, and are
+	// seen from both sides, masked walls are never portals
+	std::vector<Wall> masked;
+	std::vector<Sprite> sprites;
+
+	bool is_inside(uint32_t sector, const ivec2 &p) const
+	{
+		auto &s = sectors[sector];
+		for (uint32_t i = 0; i < s.count; i++)
+			if (walls[s.first + i].side(p) < 0)
+				return false;
+		return true;
+	}
+
+	// sector containing p, -1 if none
+	// hint is the sector p was in last time, it and its neighbours are tried first since the camera rarely
+	// moves further than that between two frames
+	int32_t sector_at(const ivec2 &p, int32_t hint = -1) const
+	{
+		if (hint >= 0 && static_cast<uint32_t>(hint) < sectors.size()) {
+			if (is_inside(hint, p))
+				return hint;
+			auto &s = sectors[hint];
+			for (uint32_t i = 0; i < s.count; i++) {
+				auto n = walls[s.first + i].portal;
+				if (n >= 0 && is_inside(n, p))
+					return n;
+			}
+		}
+		for (uint32_t i = 0; i < sectors.size(); i++)
+			if (is_inside(i, p))
+				return i;
+		return -1;
+	}
+};
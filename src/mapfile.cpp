@@ -0,0 +1,329 @@
+#include "mapfile.hpp"
+#include "file.hpp"
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <filesystem>
+#include <string>
+#include <system_error>
+#include <type_traits>
+
+namespace mapfile {
+
+namespace {
+
+struct Header {
+	static constexpr uint32_t magic_ref = 0x504D4253;	// "SBMP"
+	static constexpr uint32_t version_ref = 3;
+
+	uint32_t magic;
+	uint32_t version;
+	uint32_t wall_count;
+	uint32_t sector_count;
+	uint32_t bsp_wall_count;
+	uint32_t node_count;
+	uint32_t masked_count;
+	uint32_t sprite_count;
+	uint32_t texture_count;
+	uint32_t walls_offset;	// every array starts 64 bytes aligned
+	uint32_t sectors_offset;
+	uint32_t bsp_walls_offset;
+	uint32_t nodes_offset;
+	uint32_t masked_offset;
+	uint32_t sprites_offset;
+	uint32_t textures_offset;
+};
+
+// arrays are copied out as raw bytes, in the layout of this build
+static_assert(std::is_trivially_copyable_v<Wall> && sizeof(Wall) == 48);
+static_assert(std::is_trivially_copyable_v<Sector> && sizeof(Sector) == 20);
+static_assert(std::is_trivially_copyable_v<Bsp::Node> && sizeof(Bsp::Node) == 48);
+static_assert(std::is_trivially_copyable_v<Sprite> && sizeof(Sprite) == 28);
+static_assert(std::is_trivially_copyable_v<Texture> && sizeof(Texture) == 256);
+
+static uint32_t align(size_t offset)
+{
+	return (offset + 63) & ~static_cast<size_t>(63);
+}
+
+// the integers of s, returns their count or -1 if anything else is found
+static int32_t ints(const char *s, int32_t *res, int32_t max)
+{
+	int32_t c = 0;
+	while (true) {
+		while (*s == ' ' || *s == '\t' || *s == '\r' || *s == '\n')
+			s++;
+		if (*s == '\0')
+			return c;
+		if (c == max)
+			return -1;
+		char *end;
+		auto v = std::strtol(s, &end, 10);
+		if (end == s || v < INT32_MIN || v > INT32_MAX)
+			return -1;
+		res[c++] = v;
+		s = end;
+	}
+}
+
+template <typename T>
+static bool write(std::FILE *file, const std::vector<T> &v, uint32_t offset)
+{
+	static const uint8_t zeros[64] {};
+	size_t pad = offset - static_cast<size_t>(std::ftell(file));
+	return std::fwrite(zeros, 1, pad, file) == pad && std::fwrite(v.data(), sizeof(T), v.size(), file) == v.size();
+}
+
+template <typename T>
+static bool read(const MappedFile &file, uint32_t offset, uint32_t count, std::vector<T> &res)
+{
+	if (offset % 64 != 0 || offset + static_cast<size_t>(count) * sizeof(T) > file.size())
+		return false;
+	// the mapping is page aligned and so is every array, walls, nodes and sprites have no default constructor to
+	// resize with
+	auto first = reinterpret_cast<const T*>(static_cast<const uint8_t*>(file.data()) + offset);
+	res.assign(first, first + count);
+	return true;
+}
+
+static bool is_valid(const std::vector<Wall> &walls, size_t sector_count)
+{
+	for (auto &w : walls)
+		if (w.portal < -1 || (w.portal >= 0 && static_cast<size_t>(w.portal) >= sector_count))
+			return false;
+	return true;
+}
+
+// masked walls and sprites are never portals nor flat, their texture ids are checked by the renderer like those of
+// walls
+static bool is_valid(const std::vector<Wall> &masked, const std::vector<Sprite> &sprites)
+{
+	for (auto &w : masked)
+		if (w.portal != -1 || w.ele_up <= w.ele_low)
+			return false;
+	for (auto &s : sprites)
+		if (s.width <= 0 || s.ele_up <= s.ele_low)
+			return false;
+	return true;
+}
+
+static bool is_valid(const std::vector<Texture> &texs)
+{
+	for (auto &t : texs)
+		if (std::memchr(t.path, '\0', sizeof(t.path)) == nullptr || t.path[0] == '\0' || t.is_alpha > 1)
+			return false;
+	return true;
+}
+
+}
+
+bool parse(const char *path, Map &map)
+{
+	auto file = std::fopen(path, "r");
+	if (file == nullptr) {
+		std::printf("ERR: can't open map %s\n", path);
+		return false;
+	}
+	Map res;
+	char line[1024];
+	uint32_t n = 0;
+	const char *err = nullptr;
+	while (err == nullptr && std::fgets(line, sizeof(line), file) != nullptr) {
+		n++;
+		if (auto c = std::strchr(line, '#'))
+			*c = '\0';
+		auto s = line + std::strspn(line, " \t\r\n");
+		if (*s == '\0')
+			continue;
+		auto kind_end = s + std::strcspn(s, " \t\r\n");
+		int32_t v[9];
+		if (kind_end - s == 7 && std::strncmp(s, "texture", 7) == 0) {
+			auto p = kind_end + std::strspn(kind_end, " \t\r\n");
+			auto p_end = p + std::strcspn(p, " \t\r\n");
+			auto a = p_end + std::strspn(p_end, " \t\r\n");
+			auto a_end = a + std::strcspn(a, " \t\r\n");
+			bool is_alpha = a_end - a == 5 && std::strncmp(a, "alpha", 5) == 0;
+			Texture t{};
+			if (p == p_end || (a != a_end && !is_alpha) || a_end[std::strspn(a_end, " \t\r\n")] != '\0')
+				err = "expected texture <path> [alpha]";
+			else if (static_cast<size_t>(p_end - p) >= sizeof(t.path))
+				err = "texture path too long";
+			else {
+				std::memcpy(t.path, p, p_end - p);
+				t.is_alpha = is_alpha;
+				res.texs.emplace_back(t);
+			}
+		} else if (kind_end - s == 6 && std::strncmp(s, "sector", 6) == 0) {
+			auto c = ints(kind_end, v, 3);
+			if (c < 2)
+				err = "expected sector <ele_low> <ele_up> [light]";
+			else {
+				if (!res.sectors.empty())
+					res.sectors.back().count = res.walls.size() - res.sectors.back().first;
+				res.sectors.emplace_back(Sector{static_cast<uint32_t>(res.walls.size()), 0, v[0], v[1],
+					c > 2 ? min(max(v[2], 0), 255) : 255});
+			}
+		} else if (kind_end - s == 4 && std::strncmp(s, "wall", 4) == 0) {
+			auto c = ints(kind_end, v, 9);
+			if (c < 6)
+				err = "expected wall <ax> <ay> <bx> <by> <ele_low> <ele_up> [tex] [portal] [light]";
+			else if (v[0] == v[2] && v[1] == v[3])
+				err = "wall of length 0";
+			else if (c > 6 && v[6] < 0)
+				err = "negative texture";
+			else {
+				auto &w = res.walls.emplace_back(Wall(ivec2(v[0], v[1]), ivec2(v[2], v[3]), v[4], v[5],
+					c > 6 ? v[6] : 0, c > 7 ? v[7] : -1));
+				w.light = c > 8 ? v[8] : 0;
+			}
+		} else if (kind_end - s == 6 && std::strncmp(s, "masked", 6) == 0) {
+			auto c = ints(kind_end, v, 8);
+			if (c < 7)
+				err = "expected masked <ax> <ay> <bx> <by> <ele_low> <ele_up> <tex> [light]";
+			else if (v[0] == v[2] && v[1] == v[3])
+				err = "masked wall of length 0";
+			else if (v[5] <= v[4])
+				err = "masked wall of height 0";
+			else if (v[6] < 0)
+				err = "negative texture";
+			else {
+				auto &w = res.masked.emplace_back(Wall(ivec2(v[0], v[1]), ivec2(v[2], v[3]), v[4], v[5], v[6]));
+				w.light = c > 7 ? v[7] : 0;
+			}
+		} else if (kind_end - s == 6 && std::strncmp(s, "sprite", 6) == 0) {
+			auto c = ints(kind_end, v, 7);
+			if (c < 6)
+				err = "expected sprite <x> <y> <ele_low> <ele_up> <width> <tex> [light]";
+			else if (v[3] <= v[2] || v[4] <= 0)
+				err = "empty sprite";
+			else if (v[5] < 0)
+				err = "negative texture";
+			else
+				res.sprites.emplace_back(Sprite{ivec2(v[0], v[1]), v[2], v[3], v[4], static_cast<uint32_t>(v[5]),
+					c > 6 ? v[6] : 0});
+		} else
+			err = "expected texture, sector, wall, masked or sprite";
+	}
+	std::fclose(file);
+	if (err != nullptr) {
+		std::printf("ERR: %s:%u: %s\n", path, n, err);
+		return false;
+	}
+	if (!res.sectors.empty())
+		res.sectors.back().count = res.walls.size() - res.sectors.back().first;
+	if (!is_valid(res.walls, res.sectors.size())) {
+		std::printf("ERR: %s: portal to a missing sector\n", path);
+		return false;
+	}
+	map = std::move(res);
+	return true;
+}
+
+bool save(const char *path, const Map &map, const Bsp &bsp)
+{
+	Header h{
+		.magic = Header::magic_ref,
+		.version = Header::version_ref,
+		.wall_count = static_cast<uint32_t>(map.walls.size()),
+		.sector_count = static_cast<uint32_t>(map.sectors.size()),
+		.bsp_wall_count = static_cast<uint32_t>(bsp.walls().size()),
+		.node_count = static_cast<uint32_t>(bsp.nodes().size()),
+		.masked_count = static_cast<uint32_t>(map.masked.size()),
+		.sprite_count = static_cast<uint32_t>(map.sprites.size()),
+		.texture_count = static_cast<uint32_t>(map.texs.size()),
+		.walls_offset = align(sizeof(Header)),
+		.sectors_offset = 0,
+		.bsp_walls_offset = 0,
+		.nodes_offset = 0,
+		.masked_offset = 0,
+		.sprites_offset = 0,
+		.textures_offset = 0
+	};
+	h.sectors_offset = align(h.walls_offset + map.walls.size() * sizeof(Wall));
+	h.bsp_walls_offset = align(h.sectors_offset + map.sectors.size() * sizeof(Sector));
+	h.nodes_offset = align(h.bsp_walls_offset + bsp.walls().size() * sizeof(Wall));
+	h.masked_offset = align(h.nodes_offset + bsp.nodes().size() * sizeof(Bsp::Node));
+	h.sprites_offset = align(h.masked_offset + map.masked.size() * sizeof(Wall));
+	h.textures_offset = align(h.sprites_offset + map.sprites.size() * sizeof(Sprite));
+
+	std::string tmp = std::string(path) + ".tmp";
+	auto file = std::fopen(tmp.c_str(), "wb");
+	if (file == nullptr) {
+		std::printf("ERR: can't write map %s\n", path);
+		return false;
+	}
+	bool ok = std::fwrite(&h, sizeof(h), 1, file) == 1 &&
+		write(file, map.walls, h.walls_offset) &&
+		write(file, map.sectors, h.sectors_offset) &&
+		write(file, bsp.walls(), h.bsp_walls_offset) &&
+		write(file, bsp.nodes(), h.nodes_offset) &&
+		write(file, map.masked, h.masked_offset) &&
+		write(file, map.sprites, h.sprites_offset) &&
+		write(file, map.texs, h.textures_offset);
+	ok = std::fclose(file) == 0 && ok;
+	std::error_code ec;
+	if (ok)
+		std::filesystem::rename(tmp, path, ec);
+	if (!ok || ec) {
+		std::printf("ERR: can't write map %s\n", path);
+		std::filesystem::remove(tmp, ec);
+		return false;
+	}
+	return true;
+}
+
+bool load(const char *path, Map &map, Bsp &bsp)
+{
+	MappedFile file;
+	if (!file.open(path)) {
+		std::printf("ERR: can't open map %s\n", path);
+		return false;
+	}
+	Header h;
+	if (file.size() < sizeof(h)) {
+		std::printf("ERR: %s is not a map\n", path);
+		return false;
+	}
+	std::memcpy(&h, file.data(), sizeof(h));
+	if (h.magic != Header::magic_ref) {
+		std::printf("ERR: %s is not a map\n", path);
+		return false;
+	}
+	if (h.version != Header::version_ref) {
+		std::printf("ERR: %s is a version %u map, expected %u, convert it again\n", path, h.version, Header::version_ref);
+		return false;
+	}
+	Map res;
+	std::vector<Wall> bsp_walls;
+	std::vector<Bsp::Node> nodes;
+	bool ok = read(file, h.walls_offset, h.wall_count, res.walls) &&
+		read(file, h.sectors_offset, h.sector_count, res.sectors) &&
+		read(file, h.bsp_walls_offset, h.bsp_wall_count, bsp_walls) &&
+		read(file, h.nodes_offset, h.node_count, nodes) &&
+		read(file, h.masked_offset, h.masked_count, res.masked) &&
+		read(file, h.sprites_offset, h.sprite_count, res.sprites) &&
+		read(file, h.textures_offset, h.texture_count, res.texs);
+
+	// indices are checked once here so that a bad file can't send the renderer out of its arrays, texture ids
+	// excepted, they are checked by the renderer against the textures it loaded
+	ok = ok && is_valid(res.walls, res.sectors.size()) && is_valid(bsp_walls, res.sectors.size()) &&
+		is_valid(res.masked, res.sprites) && is_valid(res.texs);
+	for (size_t i = 0; ok && i < res.sectors.size(); i++)
+		ok = static_cast<uint64_t>(res.sectors[i].first) + res.sectors[i].count <= res.walls.size();
+	// children come after their parent, which also rules out cycles
+	for (size_t i = 0; ok && i < nodes.size(); i++) {
+		auto &n = nodes[i];
+		for (auto c : {n.front, n.back})
+			ok = ok && (c == -1 || (c > static_cast<int64_t>(i) && static_cast<size_t>(c) < nodes.size()));
+		ok = ok && static_cast<uint64_t>(n.first) + n.count <= bsp_walls.size();
+	}
+	if (!ok) {
+		std::printf("ERR: %s is truncated or inconsistent\n", path);
+		return false;
+	}
+	map = std::move(res);
+	bsp = Bsp(std::move(bsp_walls), std::move(nodes));
+	return true;
+}
+
+}
@@ -0,0 +1,31 @@
+#pragma once
+
+#include "map.hpp"
+#include "bsp.hpp"
+
+// maps on disk: a text format to write them by hand, and the binary format it compiles to
+// the binary holds the textures, walls, sectors, BSP, masked walls and sprites exactly as they are laid out in memory,
+// derived fields such as wall lengths and splits included, so loading it is mapping the file and copying arrays out,
+// with no parsing at all
+namespace mapfile {
+
+// text map, one item per line, # starts a comment
+//   texture <path> [alpha]
+//   sector <ele_low> <ele_up> [light]
+//   wall <ax> <ay> <bx> <by> <ele_low> <ele_up> [tex] [portal] [light]
+//   masked <ax> <ay> <bx> <by> <ele_low> <ele_up> <tex> [light]
+//   sprite <x> <y> <ele_low> <ele_up> <width> <tex> [light]
+// texture ids count texture lines from 0, alpha marks masked textures
+// walls following a sector line are that sector's, clockwise, a map without sectors is a wall soup
+// masked walls and sprites belong to no sector wherever they are written, they take the light of the one they stand in
+// returns false and prints where it failed on a malformed file
+bool parse(const char *path, Map &map);
+
+// binary map of map and its BSP, written aside then renamed, returns false if it can't be written
+bool save(const char *path, const Map &map, const Bsp &bsp);
+
+// returns false and prints why on a missing, truncated, inconsistent or outdated file, leaving map and bsp as is
+// texture ids are not checked, Renderer::set_map draws those past its textures with texture 0
+bool load(const char *path, Map &map, Bsp &bsp);
+
+}
@@ -0,0 +1,139 @@
+#pragma once
+
+#include <cstdint>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <deque>
+#include <vector>
+#include <memory>
+#include <functional>
+
+// Persistent worker pool running one batch of indexed tasks at a time.
+// The calling thread takes part in the batch as participant 0.
+// Tasks are dealt to participants in contiguous blocks, each participant pops its own block from the front
+// and steals from the back of the others once it runs dry, so a heavy block does not stall the whole batch.
+class Pool
+{
+	struct Queue {
+		std::mutex mtx;
+		std::deque<uint32_t> tasks;
+	};
+
+	std::vector<std::thread> m_threads;
+	std::unique_ptr<Queue[]> m_queues;
+	uint32_t m_count;
+
+	std::mutex m_mtx;
+	std::condition_variable m_start;
+	std::condition_variable m_done;
+	uint64_t m_gen = 0;
+	uint32_t m_finished = 0;
+	bool m_quit = false;
+	const std::function<void(uint32_t)> *m_fn = nullptr;
+
+	bool pop(uint32_t q, uint32_t &task)
+	{
+		auto &own = m_queues[q];
+		{
+			std::lock_guard l(own.mtx);
+			if (!own.tasks.empty()) {
+				task = own.tasks.front();
+				own.tasks.pop_front();
+				return true;
+			}
+		}
+		for (uint32_t i = 1; i < m_count; i++) {
+			auto &victim = m_queues[(q + i) % m_count];
+			std::lock_guard l(victim.mtx);
+			if (!victim.tasks.empty()) {
+				task = victim.tasks.back();
+				victim.tasks.pop_back();
+				return true;
+			}
+		}
+		return false;
+	}
+
+	void drain(uint32_t q)
+	{
+		uint32_t task;
+		while (pop(q, task))
+			(*m_fn)(task);
+	}
+
+	void work(uint32_t q)
+	{
+		uint64_t gen = 0;
+		while (true) {
+			{
+				std::unique_lock l(m_mtx);
+				m_start.wait(l, [&](){
+					return m_quit || m_gen != gen;
+				});
+				if (m_quit)
+					return;
+				gen = m_gen;
+			}
+			drain(q);
+			{
+				std::lock_guard l(m_mtx);
+				m_finished++;
+			}
+			m_done.notify_one();
+		}
+	}
+
+public:
+	// thread_count includes the calling thread
+	Pool(uint32_t thread_count) :
+		m_queues(new Queue[thread_count > 0 ? thread_count : 1]),
+		m_count(thread_count > 0 ? thread_count : 1)
+	{
+		for (uint32_t i = 1; i < m_count; i++)
+			m_threads.emplace_back([this, i](){
+				work(i);
+			});
+	}
+
+	~Pool(void)
+	{
+		{
+			std::lock_guard l(m_mtx);
+			m_quit = true;
+		}
+		m_start.notify_all();
+		for (auto &t : m_threads)
+			t.join();
+	}
+
+	uint32_t size(void) const
+	{
+		return m_count;
+	}
+
+	// returns once fn has been called for every task in [0, task_count)
+	void run(uint32_t task_count, const std::function<void(uint32_t)> &fn)
+	{
+		for (uint32_t q = 0; q < m_count; q++) {
+			auto &queue = m_queues[q];
+			uint32_t b = task_count * q / m_count;
+			uint32_t e = task_count * (q + 1) / m_count;
+			for (uint32_t i = b; i < e; i++)
+				queue.tasks.push_back(i);
+		}
+		{
+			std::lock_guard l(m_mtx);
+			m_fn = &fn;
+			m_finished = 0;
+			m_gen++;
+		}
+		m_start.notify_all();
+		drain(0);
+		std::unique_lock l(m_mtx);
+		m_done.wait(l, [&](){
+			return m_finished == m_count - 1;
+		});
+		m_fn = nullptr;
+	}
+};
@@ -0,0 +1,124 @@
+#include "prof.hpp"
+#include <atomic>
+#include <vector>
+#include <algorithm>
+#include <cstdio>
+
+namespace prof {
+
+namespace {
+
+// a seqlock per slot: seq is 0 while the slot is written, then the event index + 1
+struct Event {
+	std::atomic<uint64_t> seq;
+	std::atomic<uint64_t> begin;
+	std::atomic<uint64_t> end;
+	std::atomic<uint32_t> stage;
+	std::atomic<uint32_t> thread;
+};
+
+struct Snap {
+	uint64_t begin;
+	uint64_t end;
+	Stage stage;
+	uint32_t thread;
+};
+
+static Event events[event_count];
+static std::atomic<uint64_t> head{0};
+static std::atomic<uint32_t> thread_next{0};
+static thread_local uint32_t thread_id = thread_next.fetch_add(1, std::memory_order_relaxed);
+
+// the events still in the ring and not being overwritten, oldest first
+static std::vector<Snap> snapshot(void)
+{
+	std::vector<Snap> res;
+	auto h = head.load(std::memory_order_acquire);
+	auto first = h > event_count ? h - event_count : 0;
+	res.reserve(h - first);
+	for (auto i = first; i < h; i++) {
+		auto &e = events[i & (event_count - 1)];
+		auto seq = e.seq.load(std::memory_order_acquire);
+		if (seq != i + 1)
+			continue;
+		Snap s{e.begin.load(std::memory_order_relaxed), e.end.load(std::memory_order_relaxed),
+			static_cast<Stage>(e.stage.load(std::memory_order_relaxed)), e.thread.load(std::memory_order_relaxed)};
+		std::atomic_thread_fence(std::memory_order_acquire);
+		if (e.seq.load(std::memory_order_relaxed) != seq)
+			continue;
+		res.emplace_back(s);
+	}
+	return res;
+}
+
+}
+
+const char* name(Stage stage)
+{
+	static const char *names[] = {
+		"acquire",
+		"fence",
+		"setup",
+		"fill",
+		"flush",
+		"record",
+		"submit",
+		"present"
+	};
+	static_assert(sizeof(names) / sizeof(names[0]) == static_cast<size_t>(Stage::count));
+	return stage < Stage::count ? names[static_cast<size_t>(stage)] : "?";
+}
+
+void record(Stage stage, uint64_t begin, uint64_t end)
+{
+	auto i = head.fetch_add(1, std::memory_order_relaxed);
+	auto &e = events[i & (event_count - 1)];
+	e.seq.store(0, std::memory_order_relaxed);
+	std::atomic_thread_fence(std::memory_order_release);
+	e.begin.store(begin, std::memory_order_relaxed);
+	e.end.store(end, std::memory_order_relaxed);
+	e.stage.store(static_cast<uint32_t>(stage), std::memory_order_relaxed);
+	e.thread.store(thread_id, std::memory_order_relaxed);
+	e.seq.store(i + 1, std::memory_order_release);
+}
+
+void print_summary(void)
+{
+	auto snap = snapshot();
+	std::vector<uint64_t> ds[static_cast<size_t>(Stage::count)];
+	for (auto &s : snap)
+		ds[static_cast<size_t>(s.stage)].emplace_back(s.end - s.begin);
+	std::printf("%-8s %8s %10s %10s %10s\n", "stage", "count", "p50 ms", "p95 ms", "p99 ms");
+	for (size_t i = 0; i < static_cast<size_t>(Stage::count); i++) {
+		auto &d = ds[i];
+		if (d.empty())
+			continue;
+		std::sort(d.begin(), d.end());
+		auto pct = [&](size_t p){
+			return d[std::min(d.size() - 1, d.size() * p / 100)] * 1.0e-6;
+		};
+		std::printf("%-8s %8zu %10.3f %10.3f %10.3f\n", name(static_cast<Stage>(i)), d.size(), pct(50), pct(95), pct(99));
+	}
+}
+
+bool write_trace(const char *path)
+{
+	auto snap = snapshot();
+	auto file = std::fopen(path, "wb");
+	if (file == nullptr)
+		return false;
+	uint64_t origin = snap.empty() ? 0 : snap[0].begin;
+	for (auto &s : snap)
+		origin = std::min(origin, s.begin);
+	std::fprintf(file, "{\"traceEvents\":[\n");
+	for (size_t i = 0; i < snap.size(); i++) {
+		auto &s = snap[i];
+		std::fprintf(file, "{\"name\":\"%s\",\"ph\":\"X\",\"pid\":0,\"tid\":%u,\"ts\":%.3f,\"dur\":%.3f}%s\n",
+			name(s.stage), s.thread, (s.begin - origin) * 1.0e-3, (s.end - s.begin) * 1.0e-3,
+			i + 1 < snap.size() ? "," : "");
+	}
+	std::fprintf(file, "],\"displayTimeUnit\":\"ms\"}\n");
+	return std::fclose(file) == 0;
+}
+
+}
@@ -0,0 +1,64 @@
+#pragma once
+
+#include <cstdint>
+#include <chrono>
+
+// frame stage timings, recorded into a preallocated ring shared by every thread
+// the ring keeps the last event_count events, older ones are overwritten
+namespace prof {
+
+enum class Stage : uint32_t {
+	acquire,	// swapchain image
+	fence,	// wait for the GPU to release a slot
+	setup,	// walls to spans
+	fill,	// one column band
+	flush,	// samples made visible to the GPU
+	record,	// command buffers
+	submit,
+	present,
+	count
+};
+
+const char* name(Stage stage);
+
+static inline constexpr uint32_t event_log2 = 16;
+static inline constexpr uint32_t event_count = 1 << event_log2;
+
+// ns, steady clock
+static inline uint64_t now(void)
+{
+	return std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+// lock free, never allocates: a writer claims a slot with one fetch_add and publishes it with its sequence number
+void record(Stage stage, uint64_t begin, uint64_t end);
+
+// p50, p95 and p99 of every stage in the ring, on stdout
+void print_summary(void);
+
+// Chrome trace event JSON of the ring, one lane per thread, returns false if the file can't be written
+bool write_trace(const char *path);
+
+// times its scope
+class Scope
+{
+	Stage m_stage;
+	uint64_t m_begin;
+
+public:
+	Scope(Stage stage) :
+		m_stage(stage),
+		m_begin(now())
+	{
+	}
+
+	Scope(const Scope&) = delete;
+	Scope& operator=(const Scope&) = delete;
+
+	~Scope(void)
+	{
+		record(m_stage, m_begin, now());
+	}
+};
+
+}
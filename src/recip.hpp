@@ -0,0 +1,101 @@
+#pragma once
+
+#include <cstdint>
+#include <array>
+#include <bit>
+
+// integer division without a divide instruction, for CPUs where it is slow or missing
+// a divisor is turned once into a reciprocal, then every quotient by it is two multiplies plus a correction that
+// makes it exactly the truncated quotient of /, so frames come out the same to the bit
+namespace recip {
+
+static inline constexpr uint32_t table_log2 = 10;
+
+// entry i is 2^63 over the middle of the normalized divisors m in [2^31, 2^32) whose bits after the leading one
+// start with i, so within 2^-11 of 2^63 / m for every m of the entry
+static inline constexpr auto table = [](){
+	std::array<uint32_t, 1 << table_log2> res{};
+	for (uint64_t i = 0; i < res.size(); i++)
+		res[i] = (static_cast<uint64_t>(1) << 63) / ((static_cast<uint64_t>(1) << 31) + (2 * i + 1) * (1 << (30 - table_log2)));
+	return res;
+}();
+
+// 2^63 / m for m in [2^31, 2^32), from the table then one Newton step r (2 - m r), which squares its relative error
+// below 2^-21, see the bench check
+// r (2 - m r) = (1 - (1 - m r)^2) / m never overshoots and the step rounds down, so neither does the result
+static inline uint64_t reciprocal(uint32_t m)
+{
+	uint64_t r = table[(m >> (31 - table_log2)) & ((1 << table_log2) - 1)];
+	auto e = static_cast<int64_t>((static_cast<uint64_t>(1) << 63) - static_cast<uint64_t>(m) * r);	// 2^63 (1 - m r)
+	return r + ((static_cast<int64_t>(r) * (e >> 31)) >> 32);
+}
+
+// high 64 bits of a * b
+static inline uint64_t mulhi(uint64_t a, uint64_t b)
+{
+	return (static_cast<unsigned __int128>(a) * b) >> 64;
+}
+
+class Divisor
+{
+	uint64_t m_d;	// |d|
+	uint64_t m_r;	// 2^64 / |d| by default, within 2^-20 or 1
+	bool m_is_neg;
+
+public:
+	// d != 0
+	explicit Divisor(int64_t d) :
+		m_d(d < 0 ? 0 - static_cast<uint64_t>(d) : d),
+		m_is_neg(d < 0)
+	{
+		// |d| is m 2^(32 - s), the bits of m past its top 32 are rounded away, by 2^-31 at most, and made up for
+		auto s = std::countl_zero(m_d);
+		auto r = reciprocal((m_d << s) >> 32);
+		r -= (r >> 30) + 1;
+		if (s == 63)
+			m_r = ~static_cast<uint64_t>(0);	// 2^64 does not fit, the correction adds the missing 1
+		else
+			m_r = s >= 31 ? r << (s - 31) : r >> (31 - s);
+	}
+
+	int64_t value(void) const
+	{
+		return m_is_neg ? -static_cast<int64_t>(m_d) : m_d;
+	}
+
+	// n / |d|: the reciprocal is short so the estimate is never above the quotient, and what is left of it is
+	// estimated again from the remainder, that many times shorter, until it is exact
+	// the first estimate is off by q 2^-20 + 1 at most, every step cuts that by 2^20 until the last few units
+	uint64_t div(uint64_t n) const
+	{
+		uint64_t q = mulhi(n, m_r);
+		uint64_t rem = n - q * m_d;
+		while (rem >= m_d) {
+			auto dq = mulhi(rem, m_r);
+			dq += dq == 0;
+			q += dq;
+			rem -= dq * m_d;
+		}
+		return q;
+	}
+
+	// n / d, truncated toward zero like /
+	int64_t div(int64_t n) const
+	{
+		auto q = div(n < 0 ? 0 - static_cast<uint64_t>(n) : static_cast<uint64_t>(n));
+		return (n < 0) != m_is_neg ? 0 - q : q;
+	}
+
+	int64_t div(int32_t n) const
+	{
+		return div(static_cast<int64_t>(n));
+	}
+};
+
+// n / d for a divisor used once
+static inline int64_t div(int64_t n, int64_t d)
+{
+	return Divisor(d).div(n);
+}
+
+}
@@ -1,220 +1,1040 @@
 #pragma once
 
-#include "stb.hpp"
+#include "map.hpp"
+#include "tex.hpp"
+#include "pool.hpp"
+#include "span.hpp"
+#include "shade.hpp"
+#include "cover.hpp"
+#include "bsp.hpp"
+#include "prof.hpp"
+#include "recip.hpp"
 #include <cstdint>
 #include <vector>
-#include <cmath>
+#include <memory>
+#include <functional>
+#include <utility>
+#include <cstring>
+#include <cstdio>
+#include <bit>
+#include <algorithm>
+#include <stdexcept>
 
-static inline constexpr int32_t tex_scale(int32_t s)
+class Renderer
 {
-	return s * stb::Img::size / 1000;
-}
+public:
+	struct Stats {
+		uint64_t walls = 0;
+		uint64_t sectors = 0;
+		uint64_t nodes = 0;
+		uint64_t columns = 0;
+		uint64_t pixels = 0;
+		uint64_t writes = 0;	// pixels written, textured or background
+	};
+
+	// rgba frames hold one linear RGBA texel per pixel, indexed ones a byte into the palette of the textures
+	enum class Format {
+		rgba,
+		indexed
+	};
+
+	// everything a frame depends on besides the framebuffer it goes to, equal views draw equal frames
+	struct View {
+		ivec2 camp = ivec2(0, 0);
+		int32_t camele = 0;
+		uint32_t w = 0;
+		uint32_t h = 0;
+		uint64_t map_revision = 0;
+		uint64_t tex_revision = 0;	// streamed textures decoded so far, the next render samples the new ones
+
+		bool operator==(const View&) const = default;
+	};
+
+private:
+	struct BandStats {
+		uint64_t pixels;
+		uint64_t writes;
+	};
+
+	void *m_fb;
+	Format m_format;
+	uint32_t m_w;
+	uint32_t m_h;
+	int32_t m_wh;
+	int32_t m_hh;
+	int32_t m_wm;
+	int32_t m_hm;
 
-struct ivec2 {
-	int32_t x;
-	int32_t y;
+	Map m_map;
+	Bsp m_bsp;	// of every wall, orders them when no sector holds the camera
+	int32_t m_cam_sector = -1;
+	uint64_t m_map_revision = 0;	// bumped by every set_map
+	uint64_t m_frame = 0;	// stamps the textures every frame samples
 
-	using own = ivec2;
+	std::vector<Texture> m_tex_srcs;	// streamed stores decode from their paths again while drawing
+	tex::Store m_texs;
+	shade::Tables m_shade;
 
-	inline ivec2(int32_t x, int32_t y) :
-		x(x),
-		y(y)
+	Stats m_stats;
+
+	std::unique_ptr<Pool> m_pool;
+	std::vector<BandStats> m_band_stats;
+
+	const span::Kernel *m_kernel = &span::best;
+
+public:
+	// texs are what the texture ids of every map it draws refer to, as named by the map, at least one
+	// thread_count > 1 renders column bands in parallel on a persistent pool, the calling thread included
+	// fb holds w * h pixels of format
+	// tex_budget > 0 streams the large mip levels of the textures, keeping about that many bytes of them, walls
+	// show a small level of their texture until its large ones are decoded
+	Renderer(void *fb, uint32_t w, uint32_t h, std::vector<Texture> texs, uint32_t thread_count = 1,
+		Format format = Format::rgba, size_t tex_budget = 0) :
+		m_fb(fb),
+		m_format(format),
+		m_w(w),
+		m_h(h),
+		m_wh(m_w / 2),
+		m_hh(m_h / 2),
+		m_wm(m_w - 1),
+		m_hm(m_h - 1),
+		m_tex_srcs(std::move(texs)),
+		m_pool(thread_count > 1 ? new Pool(thread_count) : nullptr),
+		m_band_stats(thread_count > 1 ? thread_count * 4 : 1),
+		m_top(w),
+		m_bot(w),
+		m_sigs(w),
+		m_clips(m_band_stats.size()),
+		m_clip_last(w)
 	{
+		if (m_tex_srcs.empty())
+			throw std::runtime_error("no textures to draw with");
+		std::vector<tex::Source> srcs;
+		for (auto &t : m_tex_srcs)
+			srcs.emplace_back(tex::Source{t.path, t.is_alpha != 0});
+		bool is_indexed = format == Format::indexed;
+		auto cache = tex::cache_path(tex_budget > 0 ? (is_indexed ? "res/texs8" : "res/texs") :
+			(is_indexed ? "res/tex8" : "res/tex"), srcs);
+		m_texs.load(srcs, cache.c_str(), is_indexed, tex_budget);
+		m_shade.build(m_texs);
 	}
 
-	inline auto operator-(const own &other) const
+	// no divide instruction past this point: every quotient goes through a reciprocal, taken once for divisors shared
+	// by several quotients, and comes out exactly as / would give it
+
+	int32_t proj_x(const ivec2 &p)
 	{
-		return own(x - other.x, y - other.y);
+		return proj_x(p.x, recip::Divisor(p.y));
 	}
 
-	inline auto operator+(const own &other) const
+	// y is the depth of the projected point
+	int32_t proj_x(int32_t x, const recip::Divisor &y)
 	{
-		return own(x + other.x, y + other.y);
+		return y.div(x * m_hh) + m_wh;
 	}
 
-	inline auto operator*(int32_t s) const
+	int32_t proj_y(int32_t ele, const recip::Divisor &y)
 	{
-		return own(x * s, y * s);
+		return y.div(ele * m_hh) + m_hh;
 	}
 
-	inline void operator-=(const own &other)
+	int32_t lerp(int32_t a, int32_t b, int32_t scale, int32_t x)
 	{
-		*this = *this - other;
+		return lerp(a, b, recip::Divisor(scale), x);
 	}
 
-	inline void operator+=(const own &other)
+	int32_t lerp(int32_t a, int32_t b, const recip::Divisor &scale, int32_t x)
 	{
-		*this = *this + other;
+		int32_t sv = scale.value();
+		return scale.div((sv - x) * a + x * b);
 	}
 
-	int32_t dot(const own &other) const
+	// denominator of both perspective lerps at x
+	// depths times screen spans outgrow 32 bits on large maps
+	recip::Divisor persp(int32_t za, int32_t zb, int32_t scale, int32_t x)
 	{
-		return x * other.x + y * other.y;
+		return recip::Divisor(static_cast<int64_t>(scale - x) * zb + static_cast<int64_t>(x) * za);
 	}
 
-	int32_t norm_tex(void) const
+	int32_t lerp_persp(int32_t a, int32_t b, int32_t za, int32_t zb, int32_t scale, int32_t x)
 	{
-		return std::sqrt(tex_scale(dot(*this)));
+		return lerp_persp(a, b, za, zb, scale, x, persp(za, zb, scale, x));
 	}
-};
 
-inline int32_t min(int32_t a, int32_t b)
-{
-	return a < b ? a : b;
-}
+	int32_t lerp_persp(int32_t a, int32_t b, int32_t za, int32_t zb, int32_t scale, int32_t x, const recip::Divisor &den)
+	{
+		int64_t wa = static_cast<int64_t>(scale - x) * zb;
+		int64_t wb = static_cast<int64_t>(x) * za;
+		return den.div(wa * a + wb * b);
+	}
 
-inline int32_t max(int32_t a, int32_t b)
-{
-	return a > b ? a : b;
-}
-
-struct Wall {
-	ivec2 a;
-	ivec2 b;
-	int32_t ele_low;
-	int32_t ele_up;
-	int32_t w;
-	int32_t h;
-	
-	Wall(ivec2 a, ivec2 b, int32_t ele_low, int32_t ele_up) :
-		a(a),
-		b(b),
-		ele_low(ele_low),
-		ele_up(ele_up),
-		w((b - a).norm_tex()),
-		h(tex_scale((ele_up - ele_low)))
-	{
-	}
-};
+	int32_t lerp_z(int32_t za, int32_t zb, int32_t scale, int32_t x)
+	{
+		return lerp_z(za, zb, scale, persp(za, zb, scale, x));
+	}
 
-class Renderer
-{
-	uint32_t *m_fb;
-	uint32_t m_w;
-	uint32_t m_h;
-	int32_t m_wh;
-	int32_t m_hh;
-	int32_t m_wm;
-	int32_t m_hm;
+	int32_t lerp_z(int32_t za, int32_t zb, int32_t scale, const recip::Divisor &den)
+	{
+		return den.div(static_cast<int64_t>(scale) * za * zb);
+	}
 
-	std::vector<Wall> walls;
+	// the map starts empty, frames are then only background
+	// compiles the BSP of map
+	void set_map(Map map)
+	{
+		m_map = std::move(map);
+		auto bad = clamp_map_texs();
+		m_bsp = Bsp(m_map.walls);
+		warn_texs(bad);
+		on_map();
+	}
 
-	stb::Img t0;
+	// same with the BSP compiled along with map, as loaded from a binary map
+	void set_map(Map map, Bsp bsp)
+	{
+		m_map = std::move(map);
+		auto bad = clamp_map_texs();
+		if (!is_valid_texs(bsp.walls())) {
+			auto walls = bsp.walls();
+			clamp_texs(walls);
+			bsp = Bsp(std::move(walls), bsp.nodes());
+		}
+		m_bsp = std::move(bsp);
+		warn_texs(bad);
+		on_map();
+	}
 
-public:
-	Renderer(uint32_t *fb, uint32_t w, uint32_t h) :
-		m_fb(fb),
-		m_w(w),
-		m_h(h),
-		m_wh(m_w / 2),
-		m_hh(m_h / 2),
-		m_wm(m_w - 1),
-		m_hm(m_h - 1),
-		t0("res/t0.png", false)
-	{
-		walls.emplace_back(Wall{
-			ivec2(-500, 500),
-			ivec2(2000, 3000),
-			/*-800,
-			200*/
-			-500,
-			500
-		});
-		walls.emplace_back(Wall{
-			ivec2(-2000, 3000),
-			ivec2(500, 500) + ivec2(-1200, 0),
-			/*-800,
-			200*/
-			-500,
-			500
-		});
+	// frames are drawn into fb from now on, it must hold w * h pixels like the one given at construction
+	void set_fb(void *fb)
+	{
+		m_fb = fb;
 	}
 
-	int32_t proj_x(const ivec2 &p)
+	// frames are drawn at w * h from now on, the framebuffer must hold that many texels
+	void set_size(uint32_t w, uint32_t h)
 	{
-		return (p.x * m_hh) / p.y + m_wh;
+		m_w = w;
+		m_h = h;
+		m_wh = m_w / 2;
+		m_hh = m_h / 2;
+		m_wm = m_w - 1;
+		m_hm = m_h - 1;
+		m_top.resize(w);
+		m_bot.resize(w);
+		m_sigs.resize(w);
+		m_clip_last.resize(w);
 	}
 
-	int32_t proj_y(const ivec2 &p, int32_t ele)
+	// what render(camp, camele) would draw at the current size, a framebuffer still holding the frame of an equal
+	// view needs no render at all
+	View view(ivec2 camp, int32_t camele) const
 	{
-		return (ele * m_hh) / p.y + m_hh;
+		return View{camp, camele, m_w, m_h, m_map_revision, m_texs.revision()};
 	}
 
-	int32_t lerp(int32_t a, int32_t b, int32_t scale, int32_t x)
+	// waits for the textures queued by past frames to be decoded, the next frame samples them all, so that streamed
+	// frames can be reproduced
+	void wait_textures(void)
 	{
-		return ((scale - x) * a + x * b) / scale;
+		m_texs.finish();
 	}
 
-	int32_t lerp_persp(int32_t a, int32_t b, int32_t za, int32_t zb, int32_t scale, int32_t x)
+	// signature of every column of the last frame, those of two frames at a same height are equal where their
+	// columns are, so the columns that changed are found without reading the framebuffer back
+	const std::vector<uint64_t>& signatures(void) const
 	{
-		return ((scale - x) * a * zb + x * b * za) / ((scale - x) * zb + x * za);
+		return m_sigs;
 	}
 
-	int32_t lerp_z(int32_t za, int32_t zb, int32_t scale, int32_t x)
+	Format format(void) const
+	{
+		return m_format;
+	}
+
+	// 256 RGBA colors of indexed frames
+	const uint32_t* palette(void) const
+	{
+		return m_texs.palette();
+	}
+
+	const Stats& stats(void) const
+	{
+		return m_stats;
+	}
+
+	void reset_stats(void)
+	{
+		m_stats = Stats{};
+	}
+
+	// overrides the span kernel picked at startup, to compare kernels against each other
+	void set_kernel(const span::Kernel &kernel)
 	{
-		return scale * za * zb / ((scale - x) * zb + x * za);
+		m_kernel = &kernel;
 	}
 
+	// IsFill = false runs the whole wall and column setup but skips texel writes, used to split setup from fill cost
+	template <bool IsFill = true>
 	void render(ivec2 camp, int32_t camele)
 	{
-		std::memset(m_fb, 0, m_w * m_h * sizeof(uint32_t));
-		for (auto w : walls) {
-			w.a -= camp;
-			w.b -= camp;
-			w.ele_low -= camele;
-			w.ele_up -= camele;
+		setup(camp, camele);
+		if (m_format == Format::indexed)
+			fill_bands<IsFill, uint8_t>();
+		else
+			fill_bands<IsFill, uint32_t>();
+		for (auto &b : m_band_stats) {
+			m_stats.pixels += b.pixels;
+			m_stats.writes += b.writes;
+		}
+	}
 
-			if (w.a.y <= 0 || w.b.y <= 0)
-				continue;
+private:
+	// texture ids of a map are only known to be valid once compared to the store, so that a bad map can't send the
+	// renderer out of its arrays, ids past it are drawn with texture 0
+	bool is_valid_texs(const std::vector<Wall> &walls) const
+	{
+		for (auto &w : walls)
+			if (w.tex >= m_texs.size())
+				return false;
+		return true;
+	}
+
+	// walls, masked walls or sprites, returns the count of ids clamped
+	template <typename T>
+	size_t clamp_texs(std::vector<T> &items) const
+	{
+		size_t res = 0;
+		for (auto &it : items)
+			if (it.tex >= m_texs.size()) {
+				it.tex = 0;
+				res++;
+			}
+		return res;
+	}
+
+	size_t clamp_map_texs(void)
+	{
+		return clamp_texs(m_map.walls) + clamp_texs(m_map.masked) + clamp_texs(m_map.sprites);
+	}
+
+	void warn_texs(size_t bad) const
+	{
+		if (bad > 0)
+			std::printf("WARN: %zu map items use a texture past the %zu loaded, drawn with texture 0\n", bad, m_texs.size());
+	}
+
+	// wall projected and clipped to the screen, ready to be filled column by column
+	struct Span {
+		int32_t l;
+		int32_t r;
+		int32_t cl;	// columns to draw, [l, r) minus what is hidden
+		int32_t cr;
+		int32_t lu;
+		int32_t ru;
+		int32_t za;
+		int32_t zb;
+		int32_t ta;
+		int32_t tb;
+		int32_t ba;
+		int32_t bb;
+		int32_t hh;
+		int32_t h;
+		uint32_t tex;
+		int32_t light;	// of the wall and its sector
+		int32_t portal;
+		int32_t nta;	// ceiling and floor of the portal sector, its opening in this wall
+		int32_t ntb;
+		int32_t nba;
+		int32_t nbb;
+	};
+
+	std::vector<Span> m_spans;
+
+	// pending BSP node, either its subtrees or the walls on its splitter
+	struct Visit {
+		int32_t node;
+		bool is_walls;
+	};
+
+	std::vector<Visit> m_visits;
+
+	// sector whose portal wall opened columns [l, r)
+	struct Window {
+		int32_t sector;
+		int32_t l;
+		int32_t r;
+	};
+
+	std::vector<Window> m_windows;
+
+	Cover m_cover;
+
+	// open rows [top, bot) of every column, shrunk by portal steps and closed by solid walls
+	std::vector<int32_t> m_top;
+	std::vector<int32_t> m_bot;
+
+	// rows no textured run covers are background, and runs with the same rows, texels, steps and shade write the
+	// same pixels over what the runs before them wrote, so mixing every run of a column in order gives its signature
+	std::vector<uint64_t> m_sigs;
 
-			int32_t l = proj_x(w.a);
-			int32_t lu = 0;
-			int32_t r = proj_x(w.b);
-			int32_t ru = w.w;
+	// masked walls and sprites in view, far to near
+	std::vector<Span> m_masked;
 
-			if (l < 0) {
-				lu = lerp_persp(w.w, 0, w.b.y, w.a.y, r - l, r);
-				w.a.y = lerp_z(w.b.y, w.a.y, r - l, r);
-				l = 0;
+	// masked wall or sprite of the map as a wall, with the light of its sector
+	struct Masked {
+		Wall w;
+		int32_t light;
+		bool is_sprite;	// faces the camera, so never seen from behind
+	};
+
+	// found once per map since they never move, the walk only projects those of the sectors and nodes it reaches
+	std::vector<Masked> m_masked_items;
+	std::vector<std::vector<uint32_t>> m_sector_masked;	// items in every sector
+	std::vector<std::vector<uint32_t>> m_node_masked;	// items of every BSP node, past which they cross a splitter
+	std::vector<Bsp::Box> m_node_boxes;	// bounds of the walls and items of every BSP subtree
+
+	// rows of a column the opaque pass left open past a span at depth z, prev is the entry of the span before it
+	// in the same column, -1 for none
+	struct Clip {
+		int32_t z;
+		int32_t top;
+		int32_t bot;
+		int32_t prev;
+	};
+
+	std::vector<std::vector<Clip>> m_clips;	// entries of every band, only recorded on frames with masked spans
+	std::vector<int32_t> m_clip_last;	// last entry of every column
+
+	static uint64_t mix(uint64_t sig, uint64_t v)
+	{
+		sig = (sig ^ v) * 0x9e3779b97f4a7c15;
+		return sig ^ (sig >> 29);
+	}
+
+	// sig with the run of rows [r0, r1) drawn from column tex of texture id with v, dv and sd mixed in
+	// the id tells apart streamed levels that get the address of dropped ones
+	template <typename Px>
+	static uint64_t mix_run(uint64_t sig, int32_t r0, int32_t r1, const Px *tex, uint32_t id, uint32_t log2, int32_t v,
+		int32_t dv, span::Shade<Px> sd)
+	{
+		uint64_t sd_bits;
+		if constexpr (sizeof(Px) == 1)
+			sd_bits = reinterpret_cast<uintptr_t>(sd);
+		else
+			sd_bits = sd;
+		return mix(mix(mix(mix(mix(sig,
+			static_cast<uint32_t>(r0) | static_cast<uint64_t>(r1) << 32),
+			reinterpret_cast<uintptr_t>(tex) ^ static_cast<uint64_t>(log2) << 56),
+			id),
+			static_cast<uint32_t>(v) | static_cast<uint64_t>(static_cast<uint32_t>(dv)) << 32),
+			sd_bits);
+	}
+
+	// everything derived from a new map
+	void on_map(void)
+	{
+		m_cam_sector = -1;
+		m_map_revision++;
+		m_masked_items.clear();
+		m_sector_masked.assign(m_map.sectors.size(), {});
+		// an item is in the sector of p, full bright in none
+		auto add = [&](const Wall &w, const ivec2 &p, bool is_sprite){
+			auto sec = m_map.sector_at(p);
+			if (sec >= 0)
+				m_sector_masked[sec].emplace_back(m_masked_items.size());
+			m_masked_items.emplace_back(Masked{w, sec >= 0 ? m_map.sectors[sec].light : shade::light_max, is_sprite});
+		};
+		for (auto w : m_map.masked) {
+			w.portal = -1;
+			add(w, ivec2((w.a.x + w.b.x) / 2, (w.a.y + w.b.y) / 2), false);
+		}
+		for (auto &sp : m_map.sprites) {
+			// the camera never turns, so facing it is facing +y
+			Wall w(ivec2(sp.p.x - sp.width / 2, sp.p.y), ivec2(sp.p.x + sp.width - sp.width / 2, sp.p.y), sp.ele_low,
+				sp.ele_up, sp.tex);
+			w.w = tex::ref_size;
+			w.h = tex::ref_size;
+			w.light = sp.light;
+			add(w, sp.p, true);
+		}
+
+		// an item goes down the BSP as long as it is on one side of the splitters, every box on the way bounds it
+		auto &nodes = m_bsp.nodes();
+		m_node_masked.assign(nodes.size(), {});
+		m_node_boxes.clear();
+		for (auto &n : nodes)
+			m_node_boxes.emplace_back(n.box);
+		for (uint32_t i = 0; i < m_masked_items.size() && !nodes.empty(); i++) {
+			auto &w = m_masked_items[i].w;
+			int32_t node = 0;
+			while (true) {
+				auto &n = nodes[node];
+				auto &box = m_node_boxes[node];
+				box.min = ivec2(min(box.min.x, min(w.a.x, w.b.x)), min(box.min.y, min(w.a.y, w.b.y)));
+				box.max = ivec2(max(box.max.x, max(w.a.x, w.b.x)), max(box.max.y, max(w.a.y, w.b.y)));
+				auto sa = Wall::side(n.a, n.b, w.a);
+				auto sb = Wall::side(n.a, n.b, w.b);
+				int32_t next = -1;
+				if (sa >= 0 && sb >= 0 && (sa > 0 || sb > 0))
+					next = n.front;
+				else if (sa <= 0 && sb <= 0 && (sa < 0 || sb < 0))
+					next = n.back;
+				if (next < 0) {
+					m_node_masked[node].emplace_back(i);
+					break;
+				}
+				node = next;
 			}
-			if (r > m_wm) {
-				ru = lerp_persp(0, w.w, w.a.y, w.b.y, r - l, m_w - l);
-				w.b.y = lerp_z(w.a.y, w.b.y, r - l, m_w - l);
-				r = m_wm;
+		}
+	}
+
+	// projects item m over columns [cl, cr), whatever hides it is only known once the opaque pass went through them
+	void project_masked(const Masked &m, ivec2 camp, int32_t camele, int32_t cl, int32_t cr)
+	{
+		auto w = m.w;
+		if (!m.is_sprite && w.side(camp) < 0) {
+			// seen from behind, the texture is mirrored so that it reads the same from both sides
+			std::swap(w.a, w.b);
+			w.u += w.w;
+			w.w = -w.w;
+		}
+		Span s;
+		if (project(w, camp, camele, m.light, cl, cr, s))
+			m_masked.emplace_back(s);
+	}
+
+	// the masked spans the walk found are drawn far to near
+	void sort_masked(void)
+	{
+		std::stable_sort(m_masked.begin(), m_masked.end(), [](const Span &a, const Span &b){
+			return static_cast<int64_t>(a.za) + a.zb > static_cast<int64_t>(b.za) + b.zb;
+		});
+		for (auto &m : m_masked)
+			m_stats.columns += m.cr - m.cl;
+	}
+
+	void setup(ivec2 camp, int32_t camele)
+	{
+		prof::Scope scope(prof::Stage::setup);
+		m_frame++;
+		setup_walls(camp, camele);
+		sort_masked();
+		// streamed textures are only made resident or dropped here, never while bands sample them
+		for (auto &s : m_spans)
+			m_texs.use(s.tex, m_frame);
+		for (auto &s : m_masked)
+			m_texs.use(s.tex, m_frame);
+		m_texs.update(m_frame);
+	}
+
+	// masked walls and sprites are projected along, in the columns their sector or BSP node was reached through
+	void setup_walls(ivec2 camp, int32_t camele)
+	{
+		m_spans.clear();
+		m_masked.clear();
+		m_cover.reset(m_wm);	// spans never reach the last column
+		Span s;
+		if (!m_map.sectors.empty())
+			m_cam_sector = m_map.sector_at(camp, m_cam_sector);
+		if (m_cam_sector < 0) {
+			// wall soup, or camera outside of every sector: the BSP yields walls front to back, the near side of
+			// every splitter first
+			if (m_bsp.empty()) {
+				for (auto &m : m_masked_items)
+					project_masked(m, camp, camele, 0, m_w);
+				return;
 			}
-			if (l > m_wm || r < 0 || l >= r)
-				continue;
+			auto &nodes = m_bsp.nodes();
+			auto &walls = m_bsp.walls();
+			m_visits.clear();
+			m_visits.emplace_back(Visit{0, false});
+			while (!m_visits.empty() && !m_cover.is_full()) {
+				auto v = m_visits.back();
+				m_visits.pop_back();
+				auto &n = nodes[v.node];
+				if (v.is_walls) {
+					for (uint32_t i = 0; i < n.count; i++) {
+						auto &w = walls[n.first + i];
+						if (w.portal < 0 && project(w, camp, camele, shade::light_max, 0, m_w, s))
+							emit(s);
+					}
+					continue;
+				}
+				if (!is_visible(m_node_boxes[v.node], camp))
+					continue;
+				m_stats.nodes++;
+				for (auto i : m_node_masked[v.node])
+					project_masked(m_masked_items[i], camp, camele, 0, m_w);
+				bool is_front = Wall::side(n.a, n.b, camp) > 0;
+				auto near = is_front ? n.front : n.back;
+				auto far = is_front ? n.back : n.front;
+				if (far >= 0)
+					m_visits.emplace_back(Visit{far, false});
+				m_visits.emplace_back(Visit{v.node, true});
+				if (near >= 0)
+					m_visits.emplace_back(Visit{near, false});
+			}
+			return;
+		}
+
+		// flood from the camera sector through the portals, each one narrowing the columns the next sector can
+		// cover, so only walls seen through a chain of portals are projected at all
+		// sectors are convex: from inside, a column crosses exactly one of their walls, so along every column the
+		// flood reaches walls front to back
+		// a sector seen through several portals is queued once per portal, but a column enters it at most once, so
+		// the windows of a sector never overlap and all of them add up to at most w columns per sector
+		// only a map breaking convexity can flood past that, and would otherwise flood forever
+		m_windows.clear();
+		m_windows.emplace_back(Window{m_cam_sector, 0, static_cast<int32_t>(m_w)});
+		size_t columns = m_w;
+		size_t columns_max = static_cast<size_t>(m_w) * m_map.sectors.size();
+		for (size_t q = 0; q < m_windows.size() && !m_cover.is_full(); q++) {
+			auto win = m_windows[q];
+			auto &sec = m_map.sectors[win.sector];
+			m_stats.sectors++;
+			for (auto i : m_sector_masked[win.sector])
+				project_masked(m_masked_items[i], camp, camele, win.l, win.r);
+			for (uint32_t i = 0; i < sec.count; i++) {
+				auto &w = m_map.walls[sec.first + i];
+				if (!project(w, camp, camele, sec.light, win.l, win.r, s) || !emit(s) || w.portal < 0)
+					continue;
+				columns += s.cr - s.cl;
+				if (columns <= columns_max)
+					m_windows.emplace_back(Window{w.portal, s.cl, s.cr});
+			}
+		}
+	}
 
-			int32_t ta = proj_y(w.a, w.ele_low);
-			int32_t ba = proj_y(w.a, w.ele_up);
-			int32_t tb = proj_y(w.b, w.ele_low);
-			int32_t bb = proj_y(w.b, w.ele_up);
+	static constexpr int32_t near_z = 16;	// depth of the near plane, keeps projected heights within 32 bits
 
-			int32_t rl = r - l;
+	static constexpr uint32_t out_near = 1;
+	static constexpr uint32_t out_left = 2;
+	static constexpr uint32_t out_right = 4;
 
-			int32_t hh = lerp(0, w.h, w.ele_up - w.ele_low, -w.ele_low);
+	// view planes p is outside of, in camera space: the near plane, then the lines x * hh = -+y * wh that project
+	// to the left and right screen edges
+	// two points outside of a same plane can only bound something invisible
+	uint32_t outcode(const ivec2 &p) const
+	{
+		int64_t x = static_cast<int64_t>(p.x) * m_hh;
+		int64_t y = static_cast<int64_t>(p.y) * m_wh;
+		return (p.y < near_z ? out_near : 0) | (x + y < 0 ? out_left : 0) | (x - y > 0 ? out_right : 0);
+	}
+
+	// false when no part of box can show: behind the camera, outside the view or only over closed columns
+	bool is_visible(const Bsp::Box &box, ivec2 camp)
+	{
+		ivec2 ps[] = {
+			ivec2(box.min.x, box.min.y) - camp,
+			ivec2(box.max.x, box.min.y) - camp,
+			ivec2(box.min.x, box.max.y) - camp,
+			ivec2(box.max.x, box.max.y) - camp
+		};
+		uint32_t out = ~0u;
+		for (auto &p : ps)
+			out &= outcode(p);
+		if (out != 0)
+			return false;
+		// only the part of the box past the near plane can show, its columns span those of its corners
+		int32_t l = m_w;
+		int32_t r = 0;
+		for (auto &p : ps) {
+			int32_t x = proj_x(ivec2(p.x, max(p.y, near_z)));
+			l = min(l, x);
+			r = max(r, x + 1);
+		}
+		return !m_cover.is_closed(max(l, 0), min(r, m_wm));
+	}
+
+	// projects w into s, returns whether it covers any column of [cl, cr)
+	// light is that of the sector of w, full bright for a wall soup
+	bool project(Wall w, ivec2 camp, int32_t camele, int32_t light, int32_t cl, int32_t cr, Span &s)
+	{
+		w.a -= camp;
+		w.b -= camp;
+		w.ele_low -= camele;
+		w.ele_up -= camele;
+		s.portal = w.portal;
+
+		// camera space culling before any projection division: back faces, then walls entirely outside of one of
+		// the view planes
+		if (w.side(ivec2(0, 0)) <= 0 || (outcode(w.a) & outcode(w.b)) != 0)
+			return false;
+		if (w.a.y < near_z || w.b.y < near_z)
+			clip_near(w);
+
+		int32_t l = proj_x(w.a);
+		int32_t lu = w.u;
+		int32_t r = proj_x(w.b);
+		int32_t ru = w.u + w.w;
+		if (l > m_wm || r < 0 || l >= r)
+			return false;
+
+		if (l < 0) {
+			lu = lerp_persp(w.u + w.w, w.u, w.b.y, w.a.y, r - l, r);
+			w.a.y = lerp_z(w.b.y, w.a.y, r - l, r);
+			l = 0;
+		}
+		if (r > m_wm) {
+			ru = lerp_persp(w.u, w.u + w.w, w.a.y, w.b.y, r - l, m_w - l);
+			w.b.y = lerp_z(w.a.y, w.b.y, r - l, m_w - l);
+			r = m_wm;
+		}
+		if (l > m_wm || r < 0 || l >= r)
+			return false;
+		s.cl = max(l, cl);
+		s.cr = min(r, cr);
+		if (s.cl >= s.cr)
+			return false;
 
-			for (int32_t i = l; i < r; i++) {
-				auto col = m_fb + i * m_h;
-				auto x = i - l;
-				int32_t t = lerp(ta, tb, rl, x);
-				int32_t tu = 0;
-				if (t < 0) {
-					tu = lerp(hh, tu, m_hh - t, m_hh);
-					t = 0;
+		s.l = l;
+		s.r = r;
+		s.lu = lu;
+		s.ru = ru;
+		s.za = w.a.y;
+		s.zb = w.b.y;
+		recip::Divisor ya(w.a.y);
+		recip::Divisor yb(w.b.y);
+		s.ta = proj_y(w.ele_low, ya);
+		s.tb = proj_y(w.ele_low, yb);
+		s.ba = proj_y(w.ele_up, ya);
+		s.bb = proj_y(w.ele_up, yb);
+		s.hh = lerp(0, w.h, w.ele_up - w.ele_low, -w.ele_low);
+		s.h = w.h;
+		s.tex = w.tex;
+		s.light = min(max(light + w.light, 0), shade::light_max);
+		if (w.portal >= 0) {
+			auto &n = m_map.sectors[w.portal];
+			s.nta = proj_y(n.ele_low - camele, ya);
+			s.ntb = proj_y(n.ele_low - camele, yb);
+			s.nba = proj_y(n.ele_up - camele, ya);
+			s.nbb = proj_y(n.ele_up - camele, yb);
+		}
+		return true;
+	}
+
+	// cuts the part of w behind the near plane, only one of its ends is
+	// t is where the plane cuts it, in 16.16 from a to b, the texture of what is left does not move
+	void clip_near(Wall &w)
+	{
+		auto d = w.b - w.a;
+		int32_t t = recip::div(static_cast<int64_t>(near_z - w.a.y) << 16, d.y);
+		ivec2 p(w.a.x + static_cast<int32_t>(static_cast<int64_t>(d.x) * t >> 16), near_z);
+		int32_t pu = static_cast<int64_t>(w.w) * t >> 16;
+		if (w.a.y < near_z) {
+			w.a = p;
+			w.u += pu;
+			w.w -= pu;
+		} else {
+			w.b = p;
+			w.w = pu;
+		}
+	}
+
+	// queues the parts of s that are not behind a solid wall yet, solid walls then close their columns
+	// returns false when s is entirely hidden
+	bool emit(const Span &s)
+	{
+		if (m_cover.is_closed(s.cl, s.cr))
+			return false;
+		m_cover.for_open(s.cl, s.cr, [&](int32_t l, int32_t r){
+			auto &e = m_spans.emplace_back(s);
+			e.cl = l;
+			e.cr = r;
+			m_stats.columns += r - l;
+		});
+		if (s.portal < 0) {
+			m_cover.close(s.cl, s.cr);
+			m_stats.walls++;
+		}
+		return true;
+	}
+
+	template <typename Px>
+	auto kernel_fill(uint32_t log2) const
+	{
+		if constexpr (sizeof(Px) == 1)
+			return m_kernel->fill8[log2];
+		else
+			return m_kernel->fill[log2];
+	}
+
+	template <bool IsFill, typename Px>
+	void fill_bands(void)
+	{
+		if (!m_pool)
+			fill<IsFill, Px>(0, 0, m_w);
+		else {
+			// several bands per thread so stealing can even out bands crowded with walls
+			uint32_t band_count = m_band_stats.size();
+			std::function<void(uint32_t)> fn = [&](uint32_t band){
+				fill<IsFill, Px>(band, m_w * band / band_count, m_w * (band + 1) / band_count);
+			};
+			m_pool->run(band_count, fn);
+		}
+	}
+
+	// background is 0 in both formats, palette entry 0 is black
+	template <bool IsFill, typename Px>
+	static void clear(Px *col, int32_t t, int32_t b, BandStats &st)
+	{
+		if (b <= t)
+			return;
+		st.writes += b - t;
+		if constexpr (IsFill)
+			std::memset(col + t, 0, (b - t) * sizeof(Px));
+	}
+
+	// a span walked column by column from its first column in the band, u and den are at column xn
+	// u of the next column is carried over, their difference is the horizontal texel rate, den serves the depth too
+	struct Walk {
+		recip::Divisor rd;
+		int32_t rl;
+		int32_t xn;
+		recip::Divisor den;
+		int32_t u;
+	};
+
+	Walk walk(const Span &s, int32_t i)
+	{
+		int32_t rl = s.r - s.l;
+		int32_t xn = i - s.l;
+		auto den = persp(s.za, s.zb, rl, xn);
+		return Walk{recip::Divisor(rl), rl, xn, den, lerp_persp(s.lu, s.ru, s.za, s.zb, rl, xn, den)};
+	}
+
+	// column x of a span: texel column uc at rate du, depth denominator dz, rows [t, b) showing texel rows [tu, bu)
+	struct Column {
+		int32_t x;
+		int32_t uc;
+		int32_t du;
+		recip::Divisor dz;
+		int32_t t;
+		int32_t tu;
+		int32_t b;
+		int32_t bu;
+	};
+
+	// steps w to column i of s
+	Column column(const Span &s, Walk &w, int32_t i)
+	{
+		auto x = i - s.l;
+		if (w.xn != x) {
+			// closed columns were skipped, u and den are still those of the first of them
+			w.den = persp(s.za, s.zb, w.rl, x);
+			w.u = lerp_persp(s.lu, s.ru, s.za, s.zb, w.rl, x, w.den);
+		}
+		int32_t uc = w.u;
+		auto dz = w.den;
+		w.xn = x + 1;
+		w.den = persp(s.za, s.zb, w.rl, w.xn);
+		w.u = lerp_persp(s.lu, s.ru, s.za, s.zb, w.rl, w.xn, w.den);
+		int32_t du = w.u > uc ? w.u - uc : uc - w.u;
+		int32_t t = lerp(s.ta, s.tb, w.rd, x);
+		int32_t tu = 0;
+		if (t < 0) {
+			tu = lerp(s.hh, tu, m_hh - t, m_hh);
+			t = 0;
+		}
+		int32_t b = lerp(s.ba, s.bb, w.rd, x);
+		int32_t bu = s.h;
+		if (b > m_hm) {
+			bu = lerp(s.hh, bu, b - m_hh, m_hh);
+			b = m_hm;
+		}
+		return Column{x, uc, du, dz, t, tu, b, bu};
+	}
+
+	// what a column samples: texel row steps vs shifted by ls to level lod, its texel column tc, kernel and shade
+	template <typename Px>
+	struct Texels {
+		int32_t vs;
+		uint32_t lod;
+		int32_t ls;
+		int32_t tc;
+		const Px *tex;
+		uint32_t log2;
+		std::conditional_t<sizeof(Px) == 1, span::Fill8, span::Fill> fn;
+		span::Shade<Px> sd;
+	};
+
+	// c has rows, z is its depth
+	template <typename Px>
+	Texels<Px> texels(const Span &s, const Column &c, int32_t z) const
+	{
+		auto &tx = m_texs[s.tex];
+		// wall texels are given for a ref_size texture, sh scales them to this texture's level 0
+		int32_t sh = tx.log2 - tex::ref_log2;
+		int32_t bt = c.b - c.t;
+		// u does not depend on the row, v steps in 16.16 so the span is add + shift + sample only
+		// rounding the step up makes the truncated v match lerp() exactly, except on very tall columns
+		// where the accumulated excess can still push v one texel further
+		int32_t vs = recip::div(((c.bu - c.tu) << 16) + bt - 1, bt);
+
+		// the mip level keeps both texel rates under 2 per pixel, so distant walls walk a small level
+		// rate is compared in 24.8 so that it cannot overflow once scaled to the texture size
+		int32_t rate = shift(max(min(c.du, 1 << 12) << 8, (vs > 0 ? vs : -vs) >> 8), sh) >> 8;
+		uint32_t lod = rate > 1 ? min(std::bit_width(static_cast<uint32_t>(rate)) - 1, tx.log2) : 0;
+		lod = std::max(lod, m_texs.lod_min(s.tex));
+		int32_t ls = sh - lod;
+		int32_t tc = shift(c.uc, ls);
+		uint32_t log2 = tx.log2 - lod;
+		// a column is at a single depth, so is its light
+		return Texels<Px>{vs, lod, ls, tc, m_texs.column<Px>(s.tex, lod, tc), log2, kernel_fill<Px>(log2),
+			m_shade.at<Px>(shade::level(s.light, z))};
+	}
+
+	// fills columns [bl, br), bands never share a column so they never share a framebuffer cache line either
+	// spans come front to back: the rows of a column are written once, by the first wall or background covering them
+	// Px is uint32_t on rgba frames, uint8_t on indexed ones
+	template <bool IsFill, typename Px>
+	void fill(uint32_t band, int32_t bl, int32_t br)
+	{
+		auto fb = static_cast<Px*>(m_fb);
+		prof::Scope scope(prof::Stage::fill);
+		auto top = m_top.data();
+		auto bot = m_bot.data();
+		auto sigs = m_sigs.data();
+		bool is_clip = !m_masked.empty();
+		auto &clips = m_clips[band];
+		auto clip_last = m_clip_last.data();
+		clips.clear();
+		for (int32_t i = bl; i < br; i++) {
+			top[i] = 0;
+			bot[i] = m_h;
+			sigs[i] = 0;
+			clip_last[i] = -1;
+		}
+		BandStats st{};
+		for (auto &s : m_spans) {
+			int32_t ie = min(s.cr, br);
+			int32_t i = max(s.cl, bl);
+			if (i >= ie)
+				continue;
+			auto w = walk(s, i);
+			for (; i < ie; i++) {
+				if (top[i] >= bot[i])
+					continue;
+				auto col = fb + i * m_h;
+				auto c = column(s, w, i);
+				int32_t bt = c.b - c.t;
+				int32_t ct = min(max(c.t, top[i]), bot[i]);
+				int32_t cb = min(max(c.b, ct), bot[i]);
+				// solid walls draw [ct, cb), portals only the steps above and below their opening [nt, nb)
+				int32_t nt = cb;
+				int32_t nb = cb;
+				if (s.portal >= 0) {
+					nt = min(max(lerp(s.nta, s.ntb, w.rd, c.x), ct), cb);
+					nb = min(max(lerp(s.nba, s.nbb, w.rd, c.x), nt), cb);
 				}
-				int32_t b = lerp(ba, bb, rl, x);
-				int32_t bu = w.h;
-				if (b > m_hm) {
-					bu = lerp(hh, bu, b - m_hh, m_hh);
-					b = m_hm;
+
+				clear<IsFill>(col, top[i], ct, st);
+				bool is_drawn = bt > 0 && (ct < nt || nb < cb);
+				int32_t z = is_drawn || is_clip ? lerp_z(s.za, s.zb, w.rl, c.dz) : 0;
+				if (is_drawn) {
+					auto tx = texels<Px>(s, c, z);
+					for (auto [r0, r1] : {std::pair(ct, nt), std::pair(nb, cb)}) {
+						if (r1 <= r0)
+							continue;
+						st.pixels += r1 - r0;
+						st.writes += r1 - r0;
+						if constexpr (IsFill) {
+							auto v = shift((c.tu << 16) + tx.vs * (r0 - c.t), tx.ls);
+							auto dv = shift(tx.vs, tx.ls);
+							tx.fn(col + r0, tx.tex, v, dv, r1 - r0, tx.sd);
+							sigs[i] = mix_run(sigs[i], r0, r1, tx.tex, s.tex, tx.log2, v, dv, tx.sd);
+						}
+					}
+				}
+				clear<IsFill>(col, cb, bot[i], st);
+				if (s.portal >= 0) {
+					top[i] = nt;
+					bot[i] = nb;
+				} else
+					top[i] = bot[i];
+				if (is_clip) {
+					clips.emplace_back(Clip{z, top[i], bot[i], clip_last[i]});
+					clip_last[i] = clips.size() - 1;
 				}
-				int32_t bt = b - t;
-				for (int32_t j = t; j < b; j++)
-					col[j] = t0.sample(
-						lerp_persp(lu, ru, w.a.y, w.b.y, rl, x),
-						lerp(tu, bu, bt, j - t)
-					);
+			}
+		}
+		// whatever no solid wall closed is background
+		for (int32_t i = bl; i < br; i++)
+			clear<IsFill>(fb + i * m_h, top[i], bot[i], st);
+		if (is_clip)
+			fill_masked<IsFill, Px>(band, bl, br, st);
+		m_band_stats[band] = st;
+	}
+
+	// masked spans over the finished opaque frame, far to near: a masked column shows through the rows the opaque
+	// pass left open at its depth, and only the rows of its opaque posts are walked, so transparent texels cost
+	// nothing and hidden ones little more than the lookup of their column
+	template <bool IsFill, typename Px>
+	void fill_masked(uint32_t band, int32_t bl, int32_t br, BandStats &st)
+	{
+		auto fb = static_cast<Px*>(m_fb);
+		auto sigs = m_sigs.data();
+		auto &clips = m_clips[band];
+		auto clip_last = m_clip_last.data();
+		// rounded up, so that texel rows map to the rows stepping into them
+		auto ceil_div = [](int64_t n, const recip::Divisor &d){
+			auto q = d.div(n);
+			return q + (n > 0 && q * d.value() != n);
+		};
+		for (auto &s : m_masked) {
+			bool is_masked = m_texs[s.tex].posts != tex::no_posts;
+			int32_t ie = min(s.cr, br);
+			int32_t i = max(s.cl, bl);
+			if (i >= ie)
+				continue;
+			auto w = walk(s, i);
+			for (; i < ie; i++) {
+				auto c = column(s, w, i);
+				int32_t z = lerp_z(s.za, s.zb, w.rl, c.dz);
+				// open rows past the last span of the column no farther than z, spans sharing its depth hide it
+				// unless they are portals, so a masked wall fits in a portal opening
+				int32_t wt = 0;
+				int32_t wb = m_h;
+				for (auto c = clip_last[i]; c >= 0; c = clips[c].prev)
+					if (clips[c].z <= z) {
+						wt = clips[c].top;
+						wb = clips[c].bot;
+						break;
+					}
+				int32_t bt = c.b - c.t;
+				int32_t ct = max(c.t, wt);
+				int32_t cb = min(c.b, wb);
+				if (bt <= 0 || cb <= ct)
+					continue;
+				auto tx = texels<Px>(s, c, z);
+				auto col = fb + i * m_h;
+
+				// row ct + k samples texel row (v + k dv) >> 16 of the texture repeated downwards, every repeat of
+				// every post is turned into the rows that land in it
+				auto v = shift((c.tu << 16) + tx.vs * (ct - c.t), tx.ls);
+				auto dv = max(shift(tx.vs, tx.ls), 1);
+				recip::Divisor dd(dv);
+				int32_t n = cb - ct;
+				int64_t size = 1 << tx.log2;
+				tex::Post whole{0, static_cast<uint16_t>(size)};
+				auto [pf, pl] = is_masked ? m_texs.posts(s.tex, tx.lod, tx.tc) : std::pair(&whole, &whole + 1);
+				int64_t last = (v + static_cast<int64_t>(dv) * (n - 1)) >> 16;
+				for (int64_t base = (v >> 16) & ~(size - 1); base <= last; base += size)
+					for (auto p = pf; p != pl; p++) {
+						int64_t k0 = std::max<int64_t>(ceil_div(((base + p->first) << 16) - v, dd), 0);
+						int64_t k1 = std::min<int64_t>(ceil_div(((base + p->first + p->count) << 16) - v, dd), n);
+						if (k1 <= k0)
+							continue;
+						int32_t r0 = ct + k0;
+						int32_t r1 = ct + k1;
+						st.pixels += r1 - r0;
+						st.writes += r1 - r0;
+						if constexpr (IsFill) {
+							auto pv = v + dv * static_cast<int32_t>(k0);
+							tx.fn(col + r0, tx.tex, pv, dv, r1 - r0, tx.sd);
+							sigs[i] = mix_run(sigs[i], r0, r1, tx.tex, s.tex, tx.log2, pv, dv, tx.sd);
+						}
+					}
 			}
 		}
 	}
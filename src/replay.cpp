@@ -0,0 +1,105 @@
+#include "replay.hpp"
+#include <cstring>
+
+namespace replay {
+
+namespace {
+
+struct Header {
+	static constexpr uint32_t magic_ref = 0x50524253;	// "SBRP"
+	static constexpr uint32_t version_ref = 1;
+
+	uint32_t magic;
+	uint32_t version;
+};
+
+// 24 bytes a frame
+struct Record {
+	int32_t x;
+	int32_t y;
+	int32_t ele;
+	uint16_t w;
+	uint16_t h;
+	uint64_t hash;
+};
+
+static_assert(sizeof(Record) == 24);
+
+}
+
+uint64_t hash(const void *fb, size_t size)
+{
+	auto p = static_cast<const uint8_t*>(fb);
+	uint64_t h = 0xCBF29CE484222325;
+	size_t i = 0;
+	for (; i + 8 <= size; i += 8) {
+		uint64_t w;
+		std::memcpy(&w, p + i, sizeof(w));
+		h = (h ^ w) * 0x100000001B3;
+	}
+	// the tail is zero extended, so that rgba frames hash as they did when they were hashed by texel
+	if (i < size) {
+		uint64_t w = 0;
+		std::memcpy(&w, p + i, size - i);
+		h = (h ^ w) * 0x100000001B3;
+	}
+	return h;
+}
+
+Writer::~Writer(void)
+{
+	close();
+}
+
+bool Writer::open(const char *path)
+{
+	close();
+	m_file = std::fopen(path, "wb");
+	if (m_file == nullptr)
+		return false;
+	Header h{Header::magic_ref, Header::version_ref};
+	if (std::fwrite(&h, sizeof(h), 1, m_file) != 1) {
+		close();
+		return false;
+	}
+	return true;
+}
+
+void Writer::close(void)
+{
+	if (m_file == nullptr)
+		return;
+	std::fclose(m_file);
+	m_file = nullptr;
+}
+
+void Writer::write(const Frame &frame)
+{
+	Record r{frame.camp.x, frame.camp.y, frame.camele, static_cast<uint16_t>(frame.w), static_cast<uint16_t>(frame.h),
+		frame.hash};
+	std::fwrite(&r, sizeof(r), 1, m_file);
+}
+
+bool Reader::open(const char *path)
+{
+	m_size = 0;
+	if (!m_file.open(path))
+		return false;
+	Header h;
+	if (m_file.size() < sizeof(h))
+		return false;
+	std::memcpy(&h, m_file.data(), sizeof(h));
+	if (h.magic != Header::magic_ref || h.version != Header::version_ref)
+		return false;
+	m_size = (m_file.size() - sizeof(h)) / sizeof(Record);	// a truncated last frame is dropped
+	return true;
+}
+
+Frame Reader::operator[](size_t i) const
+{
+	Record r;
+	std::memcpy(&r, static_cast<const uint8_t*>(m_file.data()) + sizeof(Header) + i * sizeof(Record), sizeof(r));
+	return Frame{ivec2(r.x, r.y), r.ele, r.w, r.h, r.hash};
+}
+
+}
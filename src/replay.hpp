@@ -0,0 +1,62 @@
+#pragma once
+
+#include "map.hpp"
+#include "file.hpp"
+#include <cstdint>
+#include <cstdio>
+
+// camera of every rendered frame along with a hash of the frame, written as a compact binary trace
+// replaying a trace renders the exact same frames, and the hashes tell whether they still come out bit exact
+namespace replay {
+
+struct Frame {
+	ivec2 camp;
+	int32_t camele;
+	uint32_t w;	// render size
+	uint32_t h;
+	uint64_t hash;	// of the w * h samples
+};
+
+// FNV-1a over 64-bit words rather than bytes, to keep up with the frame rate, size in bytes
+uint64_t hash(const void *fb, size_t size);
+
+class Writer
+{
+	std::FILE *m_file = nullptr;
+
+public:
+	Writer(void) = default;
+	Writer(const Writer&) = delete;
+	Writer& operator=(const Writer&) = delete;
+	~Writer(void);
+
+	// returns false if the file can't be created
+	bool open(const char *path);
+	void close(void);
+	void write(const Frame &frame);
+
+	bool is_open(void) const
+	{
+		return m_file != nullptr;
+	}
+};
+
+class Reader
+{
+	MappedFile m_file;
+	size_t m_size = 0;
+
+public:
+	// returns false and stays empty if the file is missing or not a trace
+	bool open(const char *path);
+
+	// frame count
+	size_t size(void) const
+	{
+		return m_size;
+	}
+
+	Frame operator[](size_t i) const;
+};
+
+}
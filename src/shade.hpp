@@ -0,0 +1,47 @@
+#pragma once
+
+#include "map.hpp"
+#include "tex.hpp"
+#include "span.hpp"
+#include <cstdint>
+
+// light fading with depth, through tables built once so that shading a texel costs a single lookup
+namespace shade {
+
+static inline constexpr int32_t level_log2 = 5;
+static inline constexpr int32_t level_count = 1 << level_log2;	// 0 is black, level_count - 1 full bright
+static inline constexpr int32_t light_max = 255;	// of sectors, walls add to it
+static inline constexpr int32_t depth_log2 = 10;	// a level darker every 1024 world units
+
+// level of a column lit by light at depth z
+static inline uint32_t level(int32_t light, int32_t z)
+{
+	return min(max((light >> (8 - level_log2)) - (z >> depth_log2), 0), level_count - 1);
+}
+
+struct Tables {
+	uint32_t scale[level_count];	// rgba channel factor, over 256
+	uint8_t map[level_count * 256];	// indexed remap, 256 entries a level
+
+	// scales fall off quadratically, texels are linear and the eye is not
+	// the remaps take the palette entry nearest to each scaled entry
+	void build(const tex::Store &texs)
+	{
+		for (int32_t l = 0; l < level_count; l++) {
+			scale[l] = (l + 1) * (l + 1) * 256 / (level_count * level_count);
+			for (uint32_t i = 0; i < 256; i++)
+				map[l * 256 + i] = texs.is_indexed() ? texs.nearest(span::scale(texs.palette()[i], scale[l])) : i;
+		}
+	}
+
+	template <typename Px>
+	span::Shade<Px> at(uint32_t level) const
+	{
+		if constexpr (sizeof(Px) == 1)
+			return map + level * 256;
+		else
+			return scale[level];
+	}
+};
+
+}
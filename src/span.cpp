@@ -0,0 +1,154 @@
+#include "span.hpp"
+#include <cstdlib>
+#include <cstring>
+#include <utility>
+
+#if defined(__x86_64__) || defined(__i386__)
+#define SPAN_X86
+#include <immintrin.h>
+#endif
+
+namespace span {
+
+template <typename K, uint32_t ...Log2>
+static constexpr Kernel make_kernel(const char *name, std::integer_sequence<uint32_t, Log2...>)
+{
+	return Kernel{name, {&K::template fill<Log2, uint32_t>...}, {&K::template fill<Log2, uint8_t>...}};
+}
+
+template <typename K>
+static constexpr Kernel make_kernel(const char *name)
+{
+	return make_kernel<K>(name, std::make_integer_sequence<uint32_t, log2_count>{});
+}
+
+struct Scalar {
+	template <uint32_t Log2, typename T>
+	static void fill(T *dst, const T *tex, int32_t v, int32_t vs, int32_t n, Shade<T> shade)
+	{
+		static constexpr uint32_t mask = (1u << Log2) - 1;
+		for (int32_t i = 0; i < n; i++) {
+			if constexpr (sizeof(T) == 4)
+				dst[i] = scale(tex[(v >> 16) & mask], shade);
+			else
+				dst[i] = shade[tex[(v >> 16) & mask]];
+			v += vs;
+		}
+	}
+};
+
+const Kernel scalar = make_kernel<Scalar>("scalar");
+
+#ifdef SPAN_X86
+
+// scale() on 4 texels: red and blue, then green and alpha, as 16-bit lanes
+__attribute__((target("sse2")))
+static inline __m128i scale4(__m128i px, __m128i s)
+{
+	auto m = _mm_set1_epi16(0xFF);
+	auto rb = _mm_srli_epi16(_mm_mullo_epi16(_mm_and_si128(px, m), s), 8);
+	auto ga = _mm_andnot_si128(m, _mm_mullo_epi16(_mm_srli_epi16(px, 8), s));
+	return _mm_or_si128(rb, ga);
+}
+
+__attribute__((target("avx2")))
+static inline __m256i scale8(__m256i px, __m256i s)
+{
+	auto m = _mm256_set1_epi16(0xFF);
+	auto rb = _mm256_srli_epi16(_mm256_mullo_epi16(_mm256_and_si256(px, m), s), 8);
+	auto ga = _mm256_andnot_si256(m, _mm256_mullo_epi16(_mm256_srli_epi16(px, 8), s));
+	return _mm256_or_si256(rb, ga);
+}
+
+// no gather before AVX2: rows are computed 4 at a time, then fetched one by one and stored as a single vector
+struct Sse2 {
+	template <uint32_t Log2, typename T>
+	__attribute__((target("sse2")))
+	static void fill(T *dst, const T *tex, int32_t v, int32_t vs, int32_t n, Shade<T> shade)
+	{
+		auto vv = _mm_setr_epi32(v, v + vs, v + vs * 2, v + vs * 3);
+		auto step = _mm_set1_epi32(vs * 4);
+		auto m = _mm_set1_epi32((1u << Log2) - 1);
+		alignas(16) uint32_t rows[4];
+		int32_t i = 0;
+		for (; i + 4 <= n; i += 4) {
+			_mm_store_si128(reinterpret_cast<__m128i*>(rows), _mm_and_si128(_mm_srai_epi32(vv, 16), m));
+			if constexpr (sizeof(T) == 4) {
+				auto px = _mm_setr_epi32(tex[rows[0]], tex[rows[1]], tex[rows[2]], tex[rows[3]]);
+				_mm_storeu_si128(reinterpret_cast<__m128i*>(dst + i), scale4(px, _mm_set1_epi16(shade)));
+			} else {
+				// indices go out as one 32-bit store
+				uint32_t px = shade[tex[rows[0]]] | shade[tex[rows[1]]] << 8 | shade[tex[rows[2]]] << 16 |
+					static_cast<uint32_t>(shade[tex[rows[3]]]) << 24;
+				std::memcpy(dst + i, &px, sizeof(px));
+			}
+			vv = _mm_add_epi32(vv, step);
+		}
+		Scalar::fill<Log2>(dst + i, tex, v + vs * i, vs, n - i, shade);
+	}
+};
+
+struct Avx2 {
+	template <uint32_t Log2, typename T>
+	__attribute__((target("avx2")))
+	static void fill(T *dst, const T *tex, int32_t v, int32_t vs, int32_t n, Shade<T> shade)
+	{
+		auto vv = _mm256_add_epi32(_mm256_set1_epi32(v), _mm256_mullo_epi32(_mm256_set1_epi32(vs), _mm256_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7)));
+		auto step = _mm256_set1_epi32(vs * 8);
+		auto m = _mm256_set1_epi32((1u << Log2) - 1);
+		int32_t i = 0;
+		for (; i + 8 <= n; i += 8) {
+			auto rows = _mm256_and_si256(_mm256_srai_epi32(vv, 16), m);
+			if constexpr (sizeof(T) == 4) {
+				// gathers merge into their destination, a zeroed one keeps iterations from chaining through the scale
+				auto px = _mm256_mask_i32gather_epi32(_mm256_setzero_si256(), reinterpret_cast<const int*>(tex), rows,
+					_mm256_set1_epi32(-1), 4);
+				_mm256_storeu_si256(reinterpret_cast<__m256i*>(dst + i), scale8(px, _mm256_set1_epi16(shade)));
+			} else {
+				// byte gathers followed by a dependent gather into the remap lose to plain loads
+				alignas(32) uint32_t r[8];
+				_mm256_store_si256(reinterpret_cast<__m256i*>(r), rows);
+				for (uint32_t k = 0; k < 8; k++)
+					dst[i + k] = shade[tex[r[k]]];
+			}
+			vv = _mm256_add_epi32(vv, step);
+		}
+		Scalar::fill<Log2>(dst + i, tex, v + vs * i, vs, n - i, shade);
+	}
+};
+
+static const Kernel sse2 = make_kernel<Sse2>("sse2");
+static const Kernel avx2 = make_kernel<Avx2>("avx2");
+
+#endif
+
+uint32_t kernels(const Kernel* (&res)[kernel_max])
+{
+	uint32_t c = 0;
+	res[c++] = &scalar;
+#ifdef SPAN_X86
+	__builtin_cpu_init();
+	if (__builtin_cpu_supports("sse2"))
+		res[c++] = &sse2;
+	if (__builtin_cpu_supports("avx2"))
+		res[c++] = &avx2;
+#endif
+	return c;
+}
+
+// SBUILD_SPAN=<name> forces a kernel, to compare them on the same machine
+static const Kernel& select(void)
+{
+	const Kernel *ks[kernel_max];
+	auto c = kernels(ks);
+	auto forced = std::getenv("SBUILD_SPAN");
+	if (forced != nullptr)
+		for (uint32_t i = 0; i < c; i++)
+			if (std::strcmp(ks[i]->name, forced) == 0)
+				return *ks[i];
+	return *ks[c - 1];
+}
+
+const Kernel &best = select();
+
+}
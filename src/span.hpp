@@ -0,0 +1,45 @@
+#pragma once
+
+#include <cstdint>
+#include <type_traits>
+
+namespace span {
+
+// writes n texels of one texture column to dst, v is the 16.16 texel row, advanced by vs for every texel
+// every channel is scaled by scale / 256, scale in [0, 256]
+using Fill = void (*)(uint32_t *dst, const uint32_t *tex, int32_t v, int32_t vs, int32_t n, uint32_t scale);
+// same on palette indices, each one remapped through the 256 entries of map
+// tex must be readable 3 bytes past its end
+using Fill8 = void (*)(uint8_t *dst, const uint8_t *tex, int32_t v, int32_t vs, int32_t n, const uint8_t *map);
+
+// shade argument of the fill of T texels
+template <typename T>
+using Shade = std::conditional_t<sizeof(T) == 1, const uint8_t*, uint32_t>;
+
+// c with every channel times s / 256, two multiplies for the four channels
+static inline uint32_t scale(uint32_t c, uint32_t s)
+{
+	return ((c & 0x00FF00FF) * s >> 8 & 0x00FF00FF) | ((c >> 8 & 0x00FF00FF) * s & 0xFF00FF00);
+}
+
+// columns of 1 to 1024 texels
+static inline constexpr uint32_t log2_count = 11;
+
+// fill[l] wraps rows of a 1 << l texel column, with the mask baked in as a constant
+struct Kernel {
+	const char *name;
+	Fill fill[log2_count];
+	Fill8 fill8[log2_count];
+};
+
+extern const Kernel scalar;
+
+// kernels usable on this CPU, the scalar one first and the fastest last
+// returns the kernel count, at most kernel_max
+static inline constexpr uint32_t kernel_max = 4;
+uint32_t kernels(const Kernel* (&res)[kernel_max]);
+
+// fastest kernel for this CPU, picked once at startup
+extern const Kernel &best;
+
+}
@@ -0,0 +1,581 @@
+#include "tex.hpp"
+#include <cstdio>
+#include <cstring>
+#include <cmath>
+#include <algorithm>
+#include <filesystem>
+#include <string>
+#include <system_error>
+#include <stdexcept>
+
+namespace tex {
+
+namespace {
+
+struct CacheHeader {
+	static constexpr uint32_t magic_ref = 0x43544253;	// "SBTC"
+	static constexpr uint32_t version_ref = 4;
+
+	uint32_t magic;
+	uint32_t version;
+	uint64_t key;
+	uint32_t tex_count;
+	uint32_t texel_count;
+	uint32_t data_offset;	// texels start here, 64 bytes aligned
+	uint32_t is_indexed;	// the palette then follows the textures, texels are bytes
+	uint32_t head_count;	// post heads then posts follow the palette
+	uint32_t post_count;
+};
+
+static uint64_t fnv1a(uint64_t h, const void *data, size_t size)
+{
+	auto p = static_cast<const uint8_t*>(data);
+	for (size_t i = 0; i < size; i++)
+		h = (h ^ p[i]) * 0x100000001B3;
+	return h;
+}
+
+// changes whenever a source is renamed, reordered, resized or touched
+static uint64_t sources_key(const std::vector<Source> &srcs, bool is_indexed, bool is_streamed)
+{
+	uint64_t h = 0xCBF29CE484222325;
+	auto v = CacheHeader::version_ref;
+	h = fnv1a(h, &v, sizeof(v));
+	h = fnv1a(h, &is_indexed, sizeof(is_indexed));
+	h = fnv1a(h, &is_streamed, sizeof(is_streamed));
+	for (auto &s : srcs) {
+		h = fnv1a(h, s.path, std::strlen(s.path) + 1);
+		h = fnv1a(h, &s.is_alpha, sizeof(s.is_alpha));
+		std::error_code ec;
+		uint64_t size = std::filesystem::file_size(s.path, ec);
+		int64_t time = std::filesystem::last_write_time(s.path, ec).time_since_epoch().count();
+		h = fnv1a(h, &size, sizeof(size));
+		h = fnv1a(h, &time, sizeof(time));
+	}
+	return h;
+}
+
+static size_t palette_size(bool is_indexed)
+{
+	return is_indexed ? 256 * sizeof(uint32_t) : 0;
+}
+
+static size_t posts_size(size_t head_count, size_t post_count)
+{
+	return head_count * sizeof(uint32_t) + post_count * sizeof(Post);
+}
+
+static uint32_t data_offset(size_t tex_count, bool is_indexed, size_t head_count, size_t post_count)
+{
+	return (sizeof(CacheHeader) + tex_count * sizeof(Tex) + palette_size(is_indexed) + posts_size(head_count, post_count) + 63) & ~63;
+}
+
+static size_t data_size(size_t texel_count, bool is_indexed)
+{
+	return is_indexed ? texel_count + index_pad : texel_count * sizeof(uint32_t);
+}
+
+// texels are linear, boxes and distances are taken on their square roots so that dark colors, which linear
+// values crowd into a few levels, get their share of the palette
+struct Gamma {
+	uint8_t v[256];
+
+	Gamma(void)
+	{
+		for (uint32_t i = 0; i < 256; i++)
+			v[i] = static_cast<uint8_t>(std::sqrt(i / 255.0) * 255.0 + 0.5);
+	}
+
+	// 5:5:5 histogram bin of an RGBA texel, alpha ignored
+	uint32_t bin(uint32_t c) const
+	{
+		return (v[c & 0xFF] >> 3) | (v[c >> 8 & 0xFF] >> 3) << 5 | (v[c >> 16 & 0xFF] >> 3) << 10;
+	}
+};
+
+struct Bin {
+	uint64_t count;
+	uint64_t sum[4];
+};
+
+// box of histogram bins, bounds inclusive, on the r, g and b axes
+struct Box {
+	uint32_t min[3];
+	uint32_t max[3];
+	uint64_t count;
+};
+
+static uint32_t bin_index(uint32_t r, uint32_t g, uint32_t b)
+{
+	return r | g << 5 | b << 10;
+}
+
+template <typename Fn>
+static void for_bins(const Box &box, Fn &&fn)
+{
+	for (uint32_t b = box.min[2]; b <= box.max[2]; b++)
+		for (uint32_t g = box.min[1]; g <= box.max[1]; g++)
+			for (uint32_t r = box.min[0]; r <= box.max[0]; r++)
+				fn(r, g, b);
+}
+
+// tightens box around its non empty bins
+static void shrink(const std::vector<Bin> &hist, Box &box)
+{
+	Box res{{31, 31, 31}, {0, 0, 0}, 0};
+	for_bins(box, [&](uint32_t r, uint32_t g, uint32_t b){
+		auto c = hist[bin_index(r, g, b)].count;
+		if (c == 0)
+			return;
+		uint32_t p[3] {r, g, b};
+		for (uint32_t a = 0; a < 3; a++) {
+			res.min[a] = std::min(res.min[a], p[a]);
+			res.max[a] = std::max(res.max[a], p[a]);
+		}
+		res.count += c;
+	});
+	box = res;
+}
+
+}
+
+std::string cache_path(const char *prefix, const std::vector<Source> &srcs)
+{
+	uint64_t h = 0xCBF29CE484222325;
+	for (auto &s : srcs) {
+		h = fnv1a(h, s.path, std::strlen(s.path) + 1);
+		h = fnv1a(h, &s.is_alpha, sizeof(s.is_alpha));
+	}
+	char name[32];
+	std::snprintf(name, sizeof(name), "_%016llx.cache", static_cast<unsigned long long>(h));
+	return prefix + std::string(name);
+}
+
+// median cut: the most populated box is split at the median of its longest axis until the palette is full
+// entry 0 stays black, which is also the background
+void Store::quantize(void)
+{
+	static const Gamma gamma;
+	std::vector<Bin> hist(1 << 15);
+	// the first stored level decides the palette, mips only average it, transparent texels are never drawn
+	for (auto &t : m_texs)
+		for (uint32_t i = 0; i < 1u << ((t.log2 - t.lod_small) * 2); i++) {
+			auto c = m_arena[t.offset + i];
+			if (t.posts != no_posts && (c >> 24) < alpha_min)
+				continue;
+			auto &b = hist[gamma.bin(c)];
+			b.count++;
+			for (uint32_t k = 0; k < 4; k++)
+				b.sum[k] += c >> (k * 8) & 0xFF;
+		}
+
+	std::vector<Box> boxes;
+	boxes.emplace_back(Box{{0, 0, 0}, {31, 31, 31}, 0});
+	shrink(hist, boxes[0]);
+	if (boxes[0].count == 0)
+		boxes.clear();
+	while (boxes.size() < 255) {
+		Box *best = nullptr;
+		for (auto &b : boxes)
+			if ((b.min[0] < b.max[0] || b.min[1] < b.max[1] || b.min[2] < b.max[2]) && (best == nullptr || b.count > best->count))
+				best = &b;
+		if (best == nullptr)
+			break;
+		uint32_t axis = 0;
+		for (uint32_t a = 1; a < 3; a++)
+			if (best->max[a] - best->min[a] > best->max[axis] - best->min[axis])
+				axis = a;
+		uint64_t slices[32] {};
+		for_bins(*best, [&](uint32_t r, uint32_t g, uint32_t b){
+			uint32_t p[3] {r, g, b};
+			slices[p[axis]] += hist[bin_index(r, g, b)].count;
+		});
+		// the low half ends at the slice reaching half of the texels, and never takes the whole box
+		uint64_t acc = 0;
+		uint32_t m = best->min[axis];
+		for (; m < best->max[axis] - 1; m++) {
+			acc += slices[m];
+			if (acc * 2 >= best->count)
+				break;
+		}
+		Box hi = *best;
+		best->max[axis] = m;
+		hi.min[axis] = m + 1;
+		shrink(hist, *best);
+		shrink(hist, hi);
+		boxes.emplace_back(hi);
+	}
+
+	m_palette[0] = 0;
+	uint32_t count = 1;
+	for (auto &box : boxes) {
+		uint64_t sum[4] {};
+		for_bins(box, [&](uint32_t r, uint32_t g, uint32_t b){
+			auto &h = hist[bin_index(r, g, b)];
+			for (uint32_t k = 0; k < 4; k++)
+				sum[k] += h.sum[k];
+		});
+		uint32_t c = 0;
+		for (uint32_t k = 0; k < 4; k++)
+			c |= static_cast<uint32_t>((sum[k] + box.count / 2) / box.count) << (k * 8);
+		m_palette[count++] = c;
+	}
+
+	// every texel of every level takes the entry nearest to the center of its bin
+	m_bin_entries.assign(1 << 15, -1);
+	m_arena8.resize(m_arena.size() + index_pad);
+	for (size_t i = 0; i < m_arena.size(); i++)
+		m_arena8[i] = bin_entry(gamma.bin(m_arena[i]));
+}
+
+// found once per bin, entries the palette does not use are black like entry 0 and never win over it
+uint8_t Store::bin_entry(uint32_t bin)
+{
+	static const Gamma gamma;
+	if (m_bin_entries.empty())
+		m_bin_entries.assign(1 << 15, -1);
+	auto &res = m_bin_entries[bin];
+	if (res >= 0)
+		return res;
+	int32_t p[3] {static_cast<int32_t>(bin & 31) * 8 + 4, static_cast<int32_t>(bin >> 5 & 31) * 8 + 4, static_cast<int32_t>(bin >> 10) * 8 + 4};
+	int32_t best_d = INT32_MAX;
+	for (uint32_t e = 0; e < 256; e++) {
+		int32_t d = 0;
+		for (uint32_t k = 0; k < 3; k++) {
+			int32_t dk = p[k] - static_cast<int32_t>(gamma.v[m_palette[e] >> (k * 8) & 0xFF]);
+			d += dk * dk;
+		}
+		if (d < best_d) {
+			best_d = d;
+			res = e;
+		}
+	}
+	return res;
+}
+
+// posts of the stored levels of t
+void Store::build_posts(Tex &t)
+{
+	t.posts = m_post_heads.size();
+	auto log2 = t.log2 - t.lod_small;
+	build_posts(m_arena.data() + t.offset, log2, log2 + 1, m_post_heads, m_posts);
+}
+
+// runs of texels at alpha_min or above, for every column of levels [0, lod_end) of the mip chain of a 1 << log2
+// texture
+void Store::build_posts(const uint32_t *chain, uint32_t log2, uint32_t lod_end, std::vector<uint32_t> &heads,
+	std::vector<Post> &posts)
+{
+	for (uint32_t lod = 0; lod < lod_end; lod++) {
+		auto l = log2 - lod;
+		for (uint32_t x = 0; x < 1u << l; x++) {
+			heads.emplace_back(posts.size());
+			auto col = chain + stb::Img::level_offset(log2, lod) + (x << l);
+			uint32_t y = 0;
+			while (y < 1u << l) {
+				if ((col[y] >> 24) < alpha_min) {
+					y++;
+					continue;
+				}
+				auto first = y;
+				while (y < 1u << l && (col[y] >> 24) >= alpha_min)
+					y++;
+				posts.emplace_back(Post{static_cast<uint16_t>(first), static_cast<uint16_t>(y - first)});
+			}
+		}
+	}
+}
+
+uint8_t Store::nearest(uint32_t c) const
+{
+	static const Gamma gamma;
+	uint8_t res = 0;
+	int32_t best_d = INT32_MAX;
+	for (uint32_t e = 0; e < 256; e++) {
+		int32_t d = 0;
+		for (uint32_t k = 0; k < 3; k++) {
+			int32_t dk = gamma.v[c >> (k * 8) & 0xFF] - gamma.v[m_palette[e] >> (k * 8) & 0xFF];
+			d += dk * dk;
+		}
+		if (d < best_d) {
+			best_d = d;
+			res = e;
+		}
+	}
+	return res;
+}
+
+bool Store::load_cache(const char *path, uint64_t key, size_t tex_count)
+{
+	if (!m_cache.open(path))
+		return false;
+	auto base = static_cast<const uint8_t*>(m_cache.data());
+	CacheHeader h;
+	if (m_cache.size() < sizeof(h))
+		return false;
+	std::memcpy(&h, base, sizeof(h));
+	if (h.magic != CacheHeader::magic_ref || h.version != CacheHeader::version_ref || h.key != key ||
+		h.tex_count != tex_count || h.is_indexed != m_is_indexed ||
+		h.data_offset != data_offset(tex_count, m_is_indexed, h.head_count, h.post_count) ||
+		h.data_offset + data_size(h.texel_count, m_is_indexed) > m_cache.size())
+		return false;
+	m_texs.resize(h.tex_count);
+	auto p = base + sizeof(h);
+	std::memcpy(m_texs.data(), p, h.tex_count * sizeof(Tex));
+	p += h.tex_count * sizeof(Tex);
+	std::memcpy(m_palette, p, palette_size(m_is_indexed));
+	p += palette_size(m_is_indexed);
+	m_post_heads.resize(h.head_count);
+	std::memcpy(m_post_heads.data(), p, h.head_count * sizeof(uint32_t));
+	p += h.head_count * sizeof(uint32_t);
+	m_posts.resize(h.post_count);
+	std::memcpy(m_posts.data(), p, h.post_count * sizeof(Post));
+	if (!m_post_heads.empty() && m_post_heads.back() != m_posts.size())
+		return false;
+	for (size_t i = 1; i < m_post_heads.size(); i++)
+		if (m_post_heads[i] < m_post_heads[i - 1])
+			return false;
+	// entries are trusted no more than the header, so that a bad cache can't send column or posts out of the
+	// mapping: levels [lod_small, log2] within the texels, and the heads of every column of them plus the end one
+	for (auto &t : m_texs) {
+		if (t.log2 > log2_max || t.lod_small > t.log2)
+			return false;
+		auto l = t.log2 - t.lod_small;
+		if (t.offset + static_cast<uint64_t>(stb::Img::level_offset(l, l + 1)) > h.texel_count)
+			return false;
+		if (t.posts == no_posts)
+			continue;
+		if (static_cast<uint64_t>(t.posts) + (2u << l) > m_post_heads.size())
+			return false;
+		uint32_t c = t.posts;
+		for (uint32_t lod = 0; lod <= l; lod++)
+			for (uint32_t x = 0; x < 1u << (l - lod); x++, c++)
+				for (auto j = m_post_heads[c]; j < m_post_heads[c + 1]; j++)
+					if (m_posts[j].first + m_posts[j].count > 1u << (l - lod))
+						return false;
+	}
+	m_data = base + h.data_offset;
+	m_texel_count = h.texel_count;
+	return true;
+}
+
+void Store::write_cache(const char *path, uint64_t key) const
+{
+	CacheHeader h{
+		.magic = CacheHeader::magic_ref,
+		.version = CacheHeader::version_ref,
+		.key = key,
+		.tex_count = static_cast<uint32_t>(m_texs.size()),
+		.texel_count = static_cast<uint32_t>(m_texel_count),
+		.data_offset = data_offset(m_texs.size(), m_is_indexed, m_post_heads.size(), m_posts.size()),
+		.is_indexed = m_is_indexed,
+		.head_count = static_cast<uint32_t>(m_post_heads.size()),
+		.post_count = static_cast<uint32_t>(m_posts.size())
+	};
+	// written aside then renamed, so a crash never leaves a truncated cache that matches the key
+	std::string tmp = std::string(path) + ".tmp";
+	auto file = std::fopen(tmp.c_str(), "wb");
+	if (file == nullptr) {
+		std::printf("WARN: can't write texture cache %s\n", path);
+		return;
+	}
+	static const uint8_t zeros[64] {};
+	auto pal = palette_size(m_is_indexed);
+	auto pad = h.data_offset - sizeof(h) - m_texs.size() * sizeof(Tex) - pal - posts_size(h.head_count, h.post_count);
+	auto size = data_size(m_texel_count, m_is_indexed);
+	bool ok = std::fwrite(&h, sizeof(h), 1, file) == 1 &&
+		std::fwrite(m_texs.data(), sizeof(Tex), m_texs.size(), file) == m_texs.size() &&
+		std::fwrite(m_palette, 1, pal, file) == pal &&
+		std::fwrite(m_post_heads.data(), sizeof(uint32_t), h.head_count, file) == h.head_count &&
+		std::fwrite(m_posts.data(), sizeof(Post), h.post_count, file) == h.post_count &&
+		std::fwrite(zeros, 1, pad, file) == pad &&
+		std::fwrite(m_data, 1, size, file) == size;
+	ok = std::fclose(file) == 0 && ok;
+	std::error_code ec;
+	if (ok)
+		std::filesystem::rename(tmp, path, ec);
+	if (!ok || ec) {
+		std::printf("WARN: can't write texture cache %s\n", path);
+		std::filesystem::remove(tmp, ec);
+	}
+}
+
+void Store::load(const std::vector<Source> &srcs, const char *cache_path, bool is_indexed, size_t budget)
+{
+	m_is_indexed = is_indexed;
+	bool is_streamed = budget > 0;
+	uint64_t key = 0;
+	bool is_cached = false;
+	if (cache_path != nullptr) {
+		key = sources_key(srcs, is_indexed, is_streamed);
+		is_cached = load_cache(cache_path, key, srcs.size());
+		if (!is_cached) {
+			m_cache.close();
+			m_texs.clear();
+			m_post_heads.clear();
+			m_posts.clear();
+		}
+	}
+
+	if (!is_cached) {
+		for (auto &s : srcs) {
+			stb::Img img(s.path, s.is_alpha);
+			uint32_t lod_small = is_streamed && img.log2 > placeholder_log2 ? img.log2 - placeholder_log2 : 0;
+			auto &t = m_texs.emplace_back(Tex{
+				.offset = static_cast<uint32_t>(m_arena.size()),
+				.log2 = img.log2,
+				.posts = no_posts,
+				.lod_small = lod_small
+			});
+			m_arena.insert(m_arena.end(), img.data + stb::Img::level_offset(img.log2, lod_small), img.data + img.texel_count());
+			if (s.is_alpha)
+				build_posts(t);
+		}
+		// the last column of the last masked texture ends here
+		if (!m_post_heads.empty())
+			m_post_heads.emplace_back(m_posts.size());
+		m_texel_count = m_arena.size();
+		if (is_indexed) {
+			quantize();
+			std::vector<uint32_t>().swap(m_arena);
+			m_data = m_arena8.data();
+		} else
+			m_data = m_arena.data();
+		if (cache_path != nullptr)
+			write_cache(cache_path, key);
+	}
+
+	if (!is_streamed)
+		return;
+	m_srcs = srcs;
+	m_budget = budget;
+	m_slabs.resize(m_texs.size());
+	m_last_use.assign(m_texs.size(), 0);
+	m_is_queued.assign(m_texs.size(), false);
+	m_thread = std::thread([this](){
+		run();
+	});
+}
+
+Store::~Store(void)
+{
+	if (!m_thread.joinable())
+		return;
+	{
+		std::lock_guard l(m_mtx);
+		m_quit = true;
+	}
+	m_wake.notify_one();
+	m_thread.join();
+}
+
+// levels [0, lod_small) of texture id as the store holds them, no data if the source can't be decoded anymore
+Store::Slab Store::decode(uint32_t id)
+{
+	static const Gamma gamma;
+	auto &t = m_texs[id];
+	auto &src = m_srcs[id];
+	Slab res;
+	try {
+		stb::Img img(src.path, src.is_alpha);
+		if (img.log2 != t.log2) {
+			std::printf("WARN: texture %s changed size, keeping its placeholder\n", src.path);
+			return res;
+		}
+		size_t n = stb::Img::level_offset(t.log2, t.lod_small);
+		if (m_is_indexed) {
+			res.bytes = n + index_pad;
+			res.data.reset(new uint8_t[res.bytes]());
+			for (size_t i = 0; i < n; i++)
+				res.data[i] = bin_entry(gamma.bin(img.data[i]));
+		} else {
+			res.bytes = n * sizeof(uint32_t);
+			res.data.reset(new uint8_t[res.bytes]);
+			std::memcpy(res.data.get(), img.data, res.bytes);
+		}
+		if (t.posts != no_posts) {
+			build_posts(img.data, t.log2, t.lod_small, res.post_heads, res.posts);
+			res.post_heads.emplace_back(res.posts.size());
+		}
+	} catch (const std::runtime_error&) {
+		std::printf("WARN: can't decode texture %s, keeping its placeholder\n", src.path);
+		res = Slab{};
+	}
+	return res;
+}
+
+// decoder thread, the only one reading the sources after load
+void Store::run(void)
+{
+	std::unique_lock l(m_mtx);
+	while (true) {
+		m_wake.wait(l, [&](){
+			return m_quit || !m_queue.empty();
+		});
+		if (m_quit)
+			return;
+		auto id = m_queue.front();
+		m_queue.erase(m_queue.begin());
+		m_is_busy = true;
+		l.unlock();
+		auto slab = decode(id);
+		l.lock();
+		m_done.emplace_back(id, std::move(slab));
+		m_is_busy = false;
+		m_decoded.fetch_add(1, std::memory_order_relaxed);
+		if (m_queue.empty())
+			m_idle.notify_all();
+	}
+}
+
+void Store::queue(uint32_t id)
+{
+	m_is_queued[id] = true;
+	{
+		std::lock_guard l(m_mtx);
+		m_queue.emplace_back(id);
+	}
+	m_wake.notify_one();
+}
+
+void Store::update(uint64_t frame)
+{
+	if (m_budget == 0)
+		return;
+	std::vector<std::pair<uint32_t, Slab>> done;
+	{
+		std::lock_guard l(m_mtx);
+		done.swap(m_done);
+	}
+	for (auto &[id, slab] : done) {
+		// a source that failed stays queued, so it is not decoded again every frame
+		if (!slab.data)
+			continue;
+		m_is_queued[id] = false;
+		m_resident_bytes += slab.bytes;
+		m_slabs[id] = std::move(slab);
+	}
+	// what frame samples stays even past the budget, dropping it would only have it decoded again right away
+	while (m_resident_bytes > m_budget) {
+		int64_t lru = -1;
+		for (size_t i = 0; i < m_slabs.size(); i++)
+			if (m_slabs[i].data && m_last_use[i] != frame && (lru < 0 || m_last_use[i] < m_last_use[lru]))
+				lru = i;
+		if (lru < 0)
+			break;
+		m_resident_bytes -= m_slabs[lru].bytes;
+		m_slabs[lru] = Slab{};
+	}
+}
+
+void Store::finish(void)
+{
+	if (!m_thread.joinable())
+		return;
+	std::unique_lock l(m_mtx);
+	m_idle.wait(l, [&](){
+		return m_queue.empty() && !m_is_busy;
+	});
+}
+
+}
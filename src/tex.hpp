@@ -0,0 +1,228 @@
+#pragma once
+
+#include "stb.hpp"
+#include "file.hpp"
+#include <cstdint>
+#include <vector>
+#include <utility>
+#include <memory>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
+#include <string>
+
+namespace tex {
+
+// wall texel coordinates are expressed for a 128x128 texture, so a texture spans 1000 world units whatever its size
+static inline constexpr uint32_t ref_log2 = 7;
+static inline constexpr uint32_t ref_size = 1 << ref_log2;
+static inline constexpr uint32_t log2_max = stb::Img::log2_max;
+
+static inline constexpr uint32_t no_posts = ~0u;
+static inline constexpr uint32_t alpha_min = 128;	// texels of masked textures below it are transparent
+
+// streamed stores keep the levels of every texture from this size down, the placeholders of the larger ones
+static inline constexpr uint32_t placeholder_log2 = 4;
+
+struct Tex {
+	uint32_t offset;	// first texel of level lod_small in the arena
+	uint32_t log2;	// of level 0
+	uint32_t posts;	// first entry of the column table of a masked texture, no_posts for an opaque one
+	uint32_t lod_small;	// levels [0, lod_small) are streamed, the arena holds [lod_small, log2]
+};
+
+// opaque texel rows [first, first + count) of a column of a masked texture
+struct Post {
+	uint16_t first;
+	uint16_t count;
+};
+
+// is_alpha sources are masked: their columns are also stored as posts, so that their transparent texels are
+// skipped instead of tested
+struct Source {
+	const char *path;
+	bool is_alpha;
+};
+
+// cache file of srcs, prefix then a hash of their paths and kinds, so that source lists of different maps keep caches
+// of their own instead of rebuilding a shared one in turn
+std::string cache_path(const char *prefix, const std::vector<Source> &srcs);
+
+// texel padding after an indexed arena, leaves 8-bit span kernels free to load 4 bytes at a time
+static inline constexpr size_t index_pad = 3;
+
+// every texture with its mip chain, back to back in one arena
+// the arena is either decoded from the sources or mapped straight from the cache file, which stores it already
+// linearized, mipmapped and column-major
+// indexed stores hold one byte per texel instead, indices into a palette shared by every texture
+// streamed stores only hold the small levels of every texture in the arena, the large ones are decoded again from
+// their source by a background thread once a frame uses them, and dropped least recently used first past a budget
+class Store
+{
+	// streamed levels of a texture, [0, lod_small) back to back
+	struct Slab {
+		std::unique_ptr<uint8_t[]> data;
+		size_t bytes = 0;
+		std::vector<uint32_t> post_heads;
+		std::vector<Post> posts;
+	};
+
+	std::vector<Tex> m_texs;
+	std::vector<uint32_t> m_post_heads;	// the posts of a column are posts[heads[c], heads[c + 1])
+	std::vector<Post> m_posts;
+	std::vector<uint32_t> m_arena;
+	std::vector<uint8_t> m_arena8;
+	uint32_t m_palette[256] {};
+	bool m_is_indexed = false;
+	MappedFile m_cache;
+	const void *m_data = nullptr;
+	size_t m_texel_count = 0;
+	std::vector<int16_t> m_bin_entries;	// palette entry of every histogram bin, -1 until first needed
+
+	// residency of streamed levels, only ever changed by use and update, so never while a frame is filled
+	std::vector<Source> m_srcs;
+	size_t m_budget = 0;	// 0 when nothing is streamed
+	size_t m_resident_bytes = 0;
+	std::vector<Slab> m_slabs;
+	std::vector<uint64_t> m_last_use;
+	std::vector<bool> m_is_queued;	// decoding or decoded, not installed yet
+
+	// decoder thread, takes ids from the queue and hands slabs back through done
+	std::thread m_thread;
+	std::mutex m_mtx;
+	std::condition_variable m_wake;
+	std::condition_variable m_idle;
+	std::vector<uint32_t> m_queue;
+	std::vector<std::pair<uint32_t, Slab>> m_done;
+	bool m_is_busy = false;
+	bool m_quit = false;
+	std::atomic<uint64_t> m_decoded = 0;
+
+	bool load_cache(const char *path, uint64_t key, size_t tex_count);
+	void write_cache(const char *path, uint64_t key) const;
+	void quantize(void);
+	uint8_t bin_entry(uint32_t bin);
+	void build_posts(Tex &t);
+	static void build_posts(const uint32_t *chain, uint32_t log2, uint32_t lod_end, std::vector<uint32_t> &heads,
+		std::vector<Post> &posts);
+	Slab decode(uint32_t id);
+	void run(void);
+
+public:
+	Store(void) = default;
+	Store(const Store&) = delete;
+	Store& operator=(const Store&) = delete;
+	~Store(void);
+
+	// loads every source in order, texture ids are source indices
+	// with a cache_path the cache is used when it matches the sizes and timestamps of the sources, otherwise it
+	// is rebuilt after decoding
+	// is_indexed quantizes every texture to a common palette of 256 colors, entry 0 is black
+	// budget > 0 streams the levels larger than placeholder_log2, keeping about budget bytes of them, the sources
+	// are then decoded once up front only to build a missing cache
+	void load(const std::vector<Source> &srcs, const char *cache_path = nullptr, bool is_indexed = false,
+		size_t budget = 0);
+
+	const Tex& operator[](uint32_t id) const
+	{
+		return m_texs[id];
+	}
+
+	// a frame at stamp frame samples texture id, its streamed levels are queued for decoding if missing
+	inline void use(uint32_t id, uint64_t frame)
+	{
+		if (m_texs[id].lod_small == 0)
+			return;
+		m_last_use[id] = frame;
+		if (!m_slabs[id].data && !m_is_queued[id])
+			queue(id);
+	}
+
+	void queue(uint32_t id);
+
+	// installs what was decoded, then drops the least recently used levels past the budget, never those used by
+	// frame
+	void update(uint64_t frame);
+
+	// waits for every queued decode, the next update installs them all
+	void finish(void);
+
+	// count of decodes finished so far, the next update makes textures resident whenever it changes
+	uint64_t revision(void) const
+	{
+		return m_decoded.load(std::memory_order_relaxed);
+	}
+
+	// first level of texture id that can be sampled now
+	uint32_t lod_min(uint32_t id) const
+	{
+		auto &t = m_texs[id];
+		return m_slabs.empty() || m_slabs[id].data ? 0 : t.lod_small;
+	}
+
+	size_t resident_bytes(void) const
+	{
+		return m_resident_bytes;
+	}
+
+	size_t size(void) const
+	{
+		return m_texs.size();
+	}
+
+	size_t bytes(void) const
+	{
+		return m_texel_count * (m_is_indexed ? sizeof(uint8_t) : sizeof(uint32_t));
+	}
+
+	bool is_indexed(void) const
+	{
+		return m_is_indexed;
+	}
+
+	// 256 RGBA colors, linear like the texels they replace
+	const uint32_t* palette(void) const
+	{
+		return m_palette;
+	}
+
+	// palette entry closest to the RGBA color c, by the same measure as the quantizer
+	uint8_t nearest(uint32_t c) const;
+
+	bool is_mapped(void) const
+	{
+		return m_cache.data() != nullptr;
+	}
+
+	// column x of mip level lod of texture id, x in level texels, lod at least lod_min(id)
+	// T is uint8_t on indexed stores, uint32_t otherwise
+	template <typename T = uint32_t>
+	inline const T* column(uint32_t id, uint32_t lod, uint32_t x) const
+	{
+		auto &t = m_texs[id];
+		auto l = t.log2 - lod;
+		auto xo = (x & ((1u << l) - 1)) << l;
+		if (lod < t.lod_small)
+			return reinterpret_cast<const T*>(m_slabs[id].data.get()) + stb::Img::level_offset(t.log2, lod) + xo;
+		return static_cast<const T*>(m_data) + t.offset + stb::Img::level_offset(t.log2 - t.lod_small, lod - t.lod_small) + xo;
+	}
+
+	// opaque runs of the same column, top to bottom, texture id must be masked
+	inline std::pair<const Post*, const Post*> posts(uint32_t id, uint32_t lod, uint32_t x) const
+	{
+		auto &t = m_texs[id];
+		auto l = t.log2 - lod;
+		auto xm = x & ((1u << l) - 1);
+		// columns of the levels before lod in the same chain come first
+		if (lod < t.lod_small) {
+			auto &s = m_slabs[id];
+			auto c = (2u << t.log2) - (2u << l) + xm;
+			return {s.posts.data() + s.post_heads[c], s.posts.data() + s.post_heads[c + 1]};
+		}
+		auto c = t.posts + (2u << (t.log2 - t.lod_small)) - (2u << l) + xm;
+		return {m_posts.data() + m_post_heads[c], m_posts.data() + m_post_heads[c + 1]};
+	}
+};
+
+}